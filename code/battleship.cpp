@@ -10,7 +10,8 @@ using namespace UTILS;
 BATTLESHIP::BATTLESHIP(int xsize, int ysize, int maxlength)
 	: XSize(xsize),
 	YSize(ysize),
-	MaxLength(maxlength + 1)
+	MaxLength(maxlength + 1),
+	MemoryPool(256, true)
 {
 	NumActions = XSize * YSize;
 	NumObservations = 2;
@@ -35,6 +36,11 @@ STATE* BATTLESHIP::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* BATTLESHIP::Clone() const
+{
+	return new BATTLESHIP(*this);
+}
+
 void BATTLESHIP::Validate(const STATE& state) const
 {
 	const BATTLESHIP_STATE& bsstate = safe_cast<const BATTLESHIP_STATE&>(state);
@@ -89,6 +95,11 @@ void BATTLESHIP::FreeState(STATE* state) const
 	MemoryPool.Free(bsstate);
 }
 
+void BATTLESHIP::TrimMemory() const
+{
+	MemoryPool.Trim();
+}
+
 bool BATTLESHIP::Step(STATE& state, int action,
 	int& observation, double& reward) const
 {
@@ -188,15 +199,14 @@ bool BATTLESHIP::MoveShips(BATTLESHIP_STATE& bsstate) const
 {
 	// Number of ships to move
 	int numMoves = Random(1, 4);
-	static vector<int> shipIndices;
-	shipIndices.clear();
+	int shipIndices[3];
 
 	for (int move = 0; move < numMoves; ++move)
 	{
 		int shipIndex = Random(bsstate.Ships.size());
-		if (Contains(shipIndices, shipIndex))
+		if (find(shipIndices, shipIndices + move, shipIndex) != shipIndices + move)
 			return false;
-		shipIndices.push_back(shipIndex);
+		shipIndices[move] = shipIndex;
 		UnmarkShip(bsstate, bsstate.Ships[shipIndex]);
 	}
 
@@ -363,6 +373,26 @@ void BATTLESHIP::UnmarkShip(BATTLESHIP_STATE& bsstate, const SHIP& ship) const
 	}
 }
 
+double BATTLESHIP::BeliefEntropy(const BELIEF_STATE& beliefs) const
+{
+	// Sum of the entropies of whether each cell is occupied
+	if (beliefs.Empty())
+		return 0;
+	vector<int> numOccupied(XSize * YSize, 0);
+	for (int i = 0; i < beliefs.GetNumSamples(); i++)
+	{
+		const BATTLESHIP_STATE& bsstate =
+			safe_cast<const BATTLESHIP_STATE&>(*beliefs.GetSample(i));
+		for (int cell = 0; cell < XSize * YSize; cell++)
+			numOccupied[cell] += bsstate.Cells(cell).Occupied;
+	}
+
+	double entropy = 0;
+	for (int cell = 0; cell < XSize * YSize; cell++)
+		entropy += BinaryEntropy((double)numOccupied[cell] / beliefs.GetNumSamples());
+	return entropy;
+}
+
 void BATTLESHIP::DisplayBeliefs(const BELIEF_STATE& beliefState,
 	ostream& ostr) const
 {
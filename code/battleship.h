@@ -35,9 +35,11 @@ public:
 	BATTLESHIP(int xsize = 10, int ysize = 10, int maxlength = 4);
 
 	virtual STATE* Copy(const STATE& state) const;
+	virtual SIMULATOR* Clone() const;
 	virtual void Validate(const STATE& state) const;
 	virtual STATE* CreateStartState() const;
 	virtual void FreeState(STATE* state) const;
+	virtual void TrimMemory() const;
 	virtual bool Step(STATE& state, int action,
 		int& observation, double& reward) const;
 
@@ -46,6 +48,7 @@ public:
 	virtual bool LocalMove(STATE& state, const HISTORY& history,
 		int stepObs, const STATUS& status) const;
 
+	virtual double BeliefEntropy(const BELIEF_STATE& beliefs) const;
 	virtual void DisplayBeliefs(const BELIEF_STATE& beliefState,
 		std::ostream& ostr) const;
 	virtual void DisplayState(const STATE& state, std::ostream& ostr) const;
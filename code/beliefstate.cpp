@@ -41,6 +41,12 @@ void BELIEF_STATE::Copy(const BELIEF_STATE& beliefs, const SIMULATOR& simulator)
 
 void BELIEF_STATE::Move(BELIEF_STATE& beliefs)
 {
+	// Taking over the whole vector keeps handing off particles cheap
+	if (Samples.empty())
+	{
+		Samples.swap(beliefs.Samples);
+		return;
+	}
 	for (std::vector<STATE*>::const_iterator i_state = beliefs.Samples.begin();
 		i_state != beliefs.Samples.end(); ++i_state)
 	{
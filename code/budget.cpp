@@ -0,0 +1,71 @@
+#include "budget.h"
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+
+BUDGET::BUDGET(double total, int numSteps)
+	: Total(total),
+	Remaining(total),
+	NumSteps(numSteps),
+	Step(0),
+	InitialEntropy(-1)
+{
+}
+
+double BUDGET::Share(double entropy)
+{
+	// Entropy is measured relative to the start of the episode, where the
+	// beliefs are usually widest. The step is given (0.5 + relative) / 2 of
+	// an even split of what remains: a quarter of it for certain beliefs,
+	// up to three quarters for beliefs as wide as at the start. The rest is
+	// held back for extensions and later steps.
+	if (InitialEntropy < 0)
+		InitialEntropy = entropy;
+	double relative = InitialEntropy > 0 ? min(entropy / InitialEntropy, 1.0) : 1.0;
+	double even = Remaining / max(NumSteps - Step, 1);
+	return min(even * (0.5 + relative) / 2, Remaining);
+}
+
+double BUDGET::Extend(double share, double uncertainty) const
+{
+	assert(uncertainty >= 0 && uncertainty <= 1);
+	return min(2 * share * uncertainty, Remaining - share);
+}
+
+void BUDGET::Spend(double used)
+{
+	Remaining = max(Remaining - used, 0.0);
+	Step++;
+}
+
+void BUDGET::UnitTest()
+{
+	// Certain steps spend little and carry the rest forward
+	BUDGET budget(1000, 10);
+	double share = budget.Share(2.0);
+	assert(fabs(share - 75) < 1e-9);
+	assert(budget.Extend(share, 0) == 0);
+	assert(fabs(budget.Extend(share, 1) - 150) < 1e-9);
+	budget.Spend(share);
+	assert(fabs(budget.GetRemaining() - 925) < 1e-9);
+
+	// Settled beliefs get half an even share up front
+	share = budget.Share(0.0);
+	assert(fabs(share - 925.0 / 9 / 4) < 1e-9);
+
+	// Never more than what is left, even past the planned steps
+	for (int step = 0; step < 20; step++)
+	{
+		share = budget.Share(2.0);
+		share += budget.Extend(share, 1);
+		assert(share <= budget.GetRemaining() + 1e-9);
+		budget.Spend(share);
+	}
+	assert(budget.GetRemaining() >= 0);
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,41 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+//-----------------------------------------------------------------------------
+// Shares a total search budget for one episode out between its steps.
+// Each step is offered an even share of what is left over the remaining
+// planned steps, scaled up while the beliefs are still uncertain, and
+// anything a step does not spend is carried forward to later steps.
+// Units are whatever the search spends: simulations or milliseconds.
+
+class BUDGET
+{
+public:
+
+	BUDGET(double total, int numSteps);
+
+	// Amount to spend on this step, given the entropy of the beliefs
+	double Share(double entropy);
+
+	// Further amount for a step whose root value is still uncertain,
+	// from 0 (settled) to 1 (undecided)
+	double Extend(double share, double uncertainty) const;
+
+	// Record the amount actually spent and move on to the next step
+	void Spend(double used);
+
+	double GetRemaining() const { return Remaining; }
+	int GetStep() const { return Step; }
+
+	static void UnitTest();
+
+private:
+
+	double Total, Remaining;
+	int NumSteps, Step;
+	double InitialEntropy;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif // BUDGET_H
@@ -1,5 +1,8 @@
 #include "experiment.h"
-#include "boost/timer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
 #include <boost/property_tree/json_parser.hpp>
 
 using namespace std;
@@ -15,7 +18,8 @@ EXPERIMENT::PARAMS::PARAMS()
 	TransformAttempts(1000),
 	Accuracy(0.01),
 	UndiscountedHorizon(1000),
-	AutoExploration(true)
+	AutoExploration(true),
+	NumThreads(1)
 {
 }
 
@@ -37,6 +41,7 @@ EXPERIMENT::PARAMS::PARAMS(const std::string& filename) {
 	Accuracy = pt.get<double>("Accuracy");
 	UndiscountedHorizon = pt.get<int>("UndiscountedHorizon");
 	AutoExploration = pt.get<bool>("AutoExploration");
+	NumThreads = pt.get<int>("NumThreads");
 }
 
 EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
@@ -44,9 +49,10 @@ EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
 	EXPERIMENT::PARAMS& expParams, MCTS::PARAMS& searchParams)
 	: Real(real),
 	Simulator(simulator),
-	OutputFile(outputFile.c_str()),
 	ExpParams(expParams),
-	SearchParams(searchParams)
+	SearchParams(searchParams),
+	Pool(0),
+	OutputFile(outputFile.c_str())
 {
 	if (ExpParams.AutoExploration)
 	{
@@ -56,14 +62,45 @@ EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
 			SearchParams.ExplorationConstant = simulator.GetRewardRange();
 	}
 	MCTS::InitFastUCB(SearchParams.ExplorationConstant);
+
+	if (ExpParams.NumThreads > 1)
+	{
+		Pool = new THREAD_POOL(ExpParams.NumThreads);
+		Reals.push_back(0);
+		Simulators.push_back(0);
+		for (int i = 1; i < ExpParams.NumThreads; i++)
+		{
+			Reals.push_back(real.Clone());
+			Simulators.push_back(simulator.Clone());
+		}
+	}
+}
+
+EXPERIMENT::~EXPERIMENT()
+{
+	delete Pool;
+	for (int i = 0; i < Reals.size(); i++)
+	{
+		delete Reals[i];
+		delete Simulators[i];
+	}
 }
 
 void EXPERIMENT::Run()
 {
-	boost::timer timer;
+	RESULTS run;
+	Run(Real, Simulator, SearchParams, run, cout);
+	Results.Merge(run);
+	DisplayRun(run, Results, cout);
+}
+
+void EXPERIMENT::Run(const SIMULATOR& real, const SIMULATOR& simulator,
+	const MCTS::PARAMS& searchParams, RESULTS& results, ostream& ostr)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
 	MCTS* mcts = NULL;
-	mcts = new MCTS(Simulator, SearchParams);
+	mcts = new MCTS(simulator, searchParams);
 	double undiscountedReturn = 0.0;
 	double discountedReturn = 0.0;
 	double discount = 1.0;
@@ -71,50 +108,51 @@ void EXPERIMENT::Run()
 	bool outOfParticles = false;
 	int t;
 
-	STATE* state = Real.CreateStartState();
-	if (SearchParams.Verbose >= SearchParams.TREE)
-		Real.DisplayState(*state, cout);
+	STATE* state = real.CreateStartState();
+	if (searchParams.Verbose >= searchParams.TREE)
+		real.DisplayState(*state, ostr);
 
 	for (t = 0; t < ExpParams.NumSteps; t++)
 	{
 		int observation;
 		double reward;
         int action = mcts->SelectAction();
-		terminal = Real.Step(*state, action, observation, reward);
+		terminal = real.Step(*state, action, observation, reward);
 
-		Results.Reward.Add(reward);
+		results.Reward.Add(reward);
 		undiscountedReturn += reward;
 		discountedReturn += reward * discount;
-		discount *= Real.GetDiscount();
-		if (SearchParams.Verbose >= SearchParams.TREE)
+		discount *= real.GetDiscount();
+		if (searchParams.Verbose >= searchParams.TREE)
 		{
-			Real.DisplayAction(action, cout);
-			Real.DisplayState(*state, cout);
-			Real.DisplayObservation(*state, observation, cout);
-			Real.DisplayReward(reward, cout);
+			real.DisplayAction(action, ostr);
+			real.DisplayState(*state, ostr);
+			real.DisplayObservation(*state, observation, ostr);
+			real.DisplayReward(reward, ostr);
 		}
 
 		if (terminal)
 		{
-			cout << "Terminated" << endl;
+			ostr << "Terminated" << endl;
 			break;
 		}
 		outOfParticles = !mcts->Update(action, observation, reward);
 		if (outOfParticles)
 			break;
 
-		if (timer.elapsed() > ExpParams.TimeOut)
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (elapsed > ExpParams.TimeOut)
 		{
-			cout << "Timed out after " << t << " steps in "
-				<< Results.Time.GetTotal() << "seconds" << endl;
+			ostr << "Timed out after " << t << " steps in "
+				<< elapsed << "seconds" << endl;
 			break;
 		}
 	}
 
 	if (outOfParticles)
 	{
-		cout << "Out of particles, finishing episode with SelectRandom" << endl;
-		HISTORY history = mcts->GetHistory();
+		ostr << "Out of particles, finishing episode with SelectRandom" << endl;
+		SIMULATOR::CONTEXT context = mcts->GetContext();
 		while (++t < ExpParams.NumSteps)
 		{
 			int observation;
@@ -123,56 +161,165 @@ void EXPERIMENT::Run()
 			// This passes real state into simulator!
 			// SelectRandom must only use fully observable state
 			// to avoid "cheating"
-			int action = Simulator.SelectRandom(*state, history, mcts->GetStatus());
-			terminal = Real.Step(*state, action, observation, reward);
+			int action = simulator.SelectRandom(*state, context);
+			terminal = real.Step(*state, action, observation, reward);
 
-			Results.Reward.Add(reward);
+			results.Reward.Add(reward);
 			undiscountedReturn += reward;
 			discountedReturn += reward * discount;
-			discount *= Real.GetDiscount();
-			if (SearchParams.Verbose >= SearchParams.TREE)
+			discount *= real.GetDiscount();
+			if (searchParams.Verbose >= searchParams.TREE)
 			{
-				Real.DisplayAction(action, cout);
-				Real.DisplayState(*state, cout);
-				Real.DisplayObservation(*state, observation, cout);
-				Real.DisplayReward(reward, cout);
+				real.DisplayAction(action, ostr);
+				real.DisplayState(*state, ostr);
+				real.DisplayObservation(*state, observation, ostr);
+				real.DisplayReward(reward, ostr);
 			}
 
 			if (terminal)
 			{
-				cout << "Terminated" << endl;
+				ostr << "Terminated" << endl;
 				break;
 			}
 
-			history.Add(action, observation);
+			context.History.Add(action, observation);
 		}
 	}
 
-	Results.Time.Add(timer.elapsed());
-	Results.UndiscountedReturn.Add(undiscountedReturn);
-	Results.DiscountedReturn.Add(discountedReturn);
-	cout << "Discounted return = " << discountedReturn
-		<< ", average = " << Results.DiscountedReturn.GetMean() << endl;
-	cout << "Undiscounted return = " << undiscountedReturn
-		<< ", average = " << Results.UndiscountedReturn.GetMean() << endl;
+	results.Time.Add(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	results.UndiscountedReturn.Add(undiscountedReturn);
+	results.DiscountedReturn.Add(discountedReturn);
+	real.FreeState(state);
 	delete mcts;
+
+	// Particles of the episode are gone, so their chunks can be returned
+	real.TrimMemory();
+	simulator.TrimMemory();
+}
+
+
+void EXPERIMENT::DisplayRun(const RESULTS& run, const RESULTS& results,
+	ostream& ostr) const
+{
+	ostr << "Discounted return = " << run.DiscountedReturn.GetTotal()
+		<< ", average = " << results.DiscountedReturn.GetMean() << endl;
+	ostr << "Undiscounted return = " << run.UndiscountedReturn.GetTotal()
+		<< ", average = " << results.UndiscountedReturn.GetMean() << endl;
 }
 
 void EXPERIMENT::MultiRun()
 {
-	int numberOfRuns = ExpParams.NumRuns;
-	for (int n = 0; n < numberOfRuns; n++)
+	vector<DOUBLING> doublings(1);
+	doublings[0].SearchParams = SearchParams;
+	doublings[0].NumRuns = ExpParams.NumRuns;
+	Sweep(doublings, [&](DOUBLING& doubling)
+	{
+		cout << doubling.Log.str();
+		Results = doubling.Results;
+	});
+}
+
+void EXPERIMENT::SetDoubling(MCTS::PARAMS& searchParams, int doubling) const
+{
+	searchParams.NumSimulations = 1 << doubling; // equivalent to 2**doubling
+	searchParams.NumStartStates = 1 << doubling;
+
+	// compute how many particles should be transformed
+	if (doubling + ExpParams.TransformDoubles >= 0)
+		searchParams.NumTransforms = 1 << (doubling + ExpParams.TransformDoubles); // equivalent to 2**(doubling + ExpParams.TransformDoubles)
+	else
+		searchParams.NumTransforms = 1;
+	searchParams.MaxAttempts = searchParams.NumTransforms * ExpParams.TransformAttempts;
+}
+
+void EXPERIMENT::Sweep(vector<DOUBLING>& doublings,
+	const function<void(DOUBLING&)>& report)
+{
+	// Runs of all doublings share one queue. With several threads the
+	// largest budgets go first so the long runs do not trail at the end,
+	// a single thread keeps doubling order so each is reported as soon as
+	// it completes. Each run has its own search and random stream, and is
+	// merged in run order, so the results are the same for any number of
+	// threads. Doublings are reported in order.
+	RANDOM& random = RANDOM::Thread();
+	vector<pair<int, int> > jobs;
+	for (int d = 0; d < doublings.size(); d++)
 	{
-		cout << "Starting run " << n + 1 << " with "
-			<< SearchParams.NumSimulations << " simulations... " << endl;
-		Run();
-		if (Results.Time.GetTotal() > ExpParams.TimeOut)
+		DOUBLING& doubling = doublings[d];
+		doubling.Seed = random.Next();
+		doubling.Runs.resize(doubling.NumRuns);
+		doubling.Output.resize(doubling.NumRuns);
+		doubling.Done.assign(doubling.NumRuns, false);
+		doubling.NextRun = 0;
+		doubling.Remaining = doubling.NumRuns;
+		doubling.TimedOut = false;
+		for (int n = 0; n < doubling.NumRuns; n++)
+			jobs.push_back(make_pair(d, n));
+	}
+	if (Pool)
+		stable_sort(jobs.begin(), jobs.end(),
+			[&](const pair<int, int>& lhs, const pair<int, int>& rhs)
+			{
+				return doublings[lhs.first].SearchParams.NumSimulations
+					> doublings[rhs.first].SearchParams.NumSimulations;
+			});
+
+	RANDOM saved = random;
+	atomic<int> nextJob(0);
+	int nextReport = 0;
+	mutex sweepMutex;
+
+	auto worker = [&](int task, int thread)
+	{
+		for (int job = nextJob++; job < jobs.size(); job = nextJob++)
 		{
-			cout << "Timed out after " << n << " runs in "
-				<< Results.Time.GetTotal() << "seconds" << endl;
-			break;
+			DOUBLING& doubling = doublings[jobs[job].first];
+			int n = jobs[job].second;
+
+			bool skip;
+			{
+				lock_guard<mutex> lock(sweepMutex);
+				skip = doubling.TimedOut;
+			}
+			if (!skip)
+			{
+				RANDOM::Thread().Seed(doubling.Seed, n);
+				ostringstream output;
+				output << "Starting run " << n + 1 << " with "
+					<< doubling.SearchParams.NumSimulations << " simulations... " << endl;
+				Run(thread ? *Reals[thread] : Real, thread ? *Simulators[thread] : Simulator,
+					doubling.SearchParams, doubling.Runs[n], output);
+				doubling.Output[n] = output.str();
+			}
+
+			lock_guard<mutex> lock(sweepMutex);
+			doubling.Done[n] = true;
+			doubling.Remaining--;
+			for (; !doubling.TimedOut && doubling.NextRun < doubling.NumRuns
+				&& doubling.Done[doubling.NextRun]; doubling.NextRun++)
+			{
+				const RESULTS& run = doubling.Runs[doubling.NextRun];
+				doubling.Results.Merge(run);
+				doubling.Log << doubling.Output[doubling.NextRun];
+				DisplayRun(run, doubling.Results, doubling.Log);
+				if (doubling.Results.Time.GetTotal() > ExpParams.TimeOut)
+				{
+					doubling.Log << "Timed out after " << doubling.NextRun << " runs in "
+						<< doubling.Results.Time.GetTotal() << "seconds" << endl;
+					doubling.TimedOut = true;
+				}
+			}
+
+			for (; nextReport < doublings.size() && doublings[nextReport].Remaining == 0; nextReport++)
+				report(doublings[nextReport]);
 		}
-	}
+	};
+
+	if (Pool)
+		Pool->Run(Pool->GetNumThreads(), worker);
+	else
+		worker(0, 0);
+	random = saved;
 }
 
 void EXPERIMENT::DiscountedReturn()
@@ -183,36 +330,34 @@ void EXPERIMENT::DiscountedReturn()
 	ExpParams.SimSteps = Simulator.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
 	ExpParams.NumSteps = Real.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
 
+	vector<DOUBLING> doublings(ExpParams.MaxDoubles - ExpParams.MinDoubles + 1);
 	for (int i = ExpParams.MinDoubles; i <= ExpParams.MaxDoubles; i++)
 	{
-		SearchParams.NumSimulations = 1 << i; // equivalent to 2**i
-		SearchParams.NumStartStates = 1 << i; 
-
-		// compute how many particles should be transformed
-		if (i + ExpParams.TransformDoubles >= 0)
-			SearchParams.NumTransforms = 1 << (i + ExpParams.TransformDoubles); // equivalent to 2**(i + ExpParams.TransformDoubles)
-		else
-			SearchParams.NumTransforms = 1;
-		SearchParams.MaxAttempts = SearchParams.NumTransforms * ExpParams.TransformAttempts;
-
-		Results.Clear();
-		MultiRun();
-
-		cout << "Simulations = " << SearchParams.NumSimulations << endl
-			<< "Runs = " << Results.Time.GetCount() << endl
-			<< "Undiscounted return = " << Results.UndiscountedReturn.GetMean()
-			<< " +- " << Results.UndiscountedReturn.GetStdErr() << endl
-			<< "Discounted return = " << Results.DiscountedReturn.GetMean()
-			<< " +- " << Results.DiscountedReturn.GetStdErr() << endl
-			<< "Time = " << Results.Time.GetMean() << endl;
-		OutputFile << SearchParams.NumSimulations << ","
-			<< Results.Time.GetCount() << ","
-			<< Results.UndiscountedReturn.GetMean() << ","
-			<< Results.UndiscountedReturn.GetStdErr() << ","
-			<< Results.DiscountedReturn.GetMean() << ","
-			<< Results.DiscountedReturn.GetStdErr() << ","
-			<< Results.Time.GetMean() << endl;
+		DOUBLING& doubling = doublings[i - ExpParams.MinDoubles];
+		doubling.SearchParams = SearchParams;
+		SetDoubling(doubling.SearchParams, i);
+		doubling.NumRuns = ExpParams.NumRuns;
 	}
+
+	Sweep(doublings, [&](DOUBLING& doubling)
+	{
+		const RESULTS& results = doubling.Results;
+		cout << doubling.Log.str();
+		cout << "Simulations = " << doubling.SearchParams.NumSimulations << endl
+			<< "Runs = " << results.Time.GetCount() << endl
+			<< "Undiscounted return = " << results.UndiscountedReturn.GetMean()
+			<< " +- " << results.UndiscountedReturn.GetStdErr() << endl
+			<< "Discounted return = " << results.DiscountedReturn.GetMean()
+			<< " +- " << results.DiscountedReturn.GetStdErr() << endl
+			<< "Time = " << results.Time.GetMean() << endl;
+		OutputFile << doubling.SearchParams.NumSimulations << ","
+			<< results.Time.GetCount() << ","
+			<< results.UndiscountedReturn.GetMean() << ","
+			<< results.UndiscountedReturn.GetStdErr() << ","
+			<< results.DiscountedReturn.GetMean() << ","
+			<< results.DiscountedReturn.GetStdErr() << ","
+			<< results.Time.GetMean() << endl;
+	});
 }
 
 void EXPERIMENT::AverageReward()
@@ -222,31 +367,31 @@ void EXPERIMENT::AverageReward()
 
 	ExpParams.SimSteps = Simulator.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
 
+	vector<DOUBLING> doublings(ExpParams.MaxDoubles - ExpParams.MinDoubles + 1);
 	for (int i = ExpParams.MinDoubles; i <= ExpParams.MaxDoubles; i++)
 	{
-		SearchParams.NumSimulations = 1 << i;
-		SearchParams.NumStartStates = 1 << i;
-		if (i + ExpParams.TransformDoubles >= 0)
-			SearchParams.NumTransforms = 1 << (i + ExpParams.TransformDoubles);
-		else
-			SearchParams.NumTransforms = 1;
-		SearchParams.MaxAttempts = SearchParams.NumTransforms * ExpParams.TransformAttempts;
-
-		Results.Clear();
-		Run();
-
-		cout << "Simulations = " << SearchParams.NumSimulations << endl
-			<< "Steps = " << Results.Reward.GetCount() << endl
-			<< "Average reward = " << Results.Reward.GetMean()
-			<< " +- " << Results.Reward.GetStdErr() << endl
-			<< "Average time = " << Results.Time.GetMean() / Results.Reward.GetCount() << endl;
-		OutputFile << SearchParams.NumSimulations << ","
-			<< Results.Reward.GetCount() << ","
-			<< Results.Reward.GetMean() << ","
-			<< Results.Reward.GetStdErr() << ","
-			<< Results.Time.GetMean() / Results.Reward.GetCount() << endl;
-		OutputFile.flush();
+		DOUBLING& doubling = doublings[i - ExpParams.MinDoubles];
+		doubling.SearchParams = SearchParams;
+		SetDoubling(doubling.SearchParams, i);
+		doubling.NumRuns = 1;
 	}
+
+	Sweep(doublings, [&](DOUBLING& doubling)
+	{
+		const RESULTS& results = doubling.Results;
+		cout << doubling.Log.str();
+		cout << "Simulations = " << doubling.SearchParams.NumSimulations << endl
+			<< "Steps = " << results.Reward.GetCount() << endl
+			<< "Average reward = " << results.Reward.GetMean()
+			<< " +- " << results.Reward.GetStdErr() << endl
+			<< "Average time = " << results.Time.GetMean() / results.Reward.GetCount() << endl;
+		OutputFile << doubling.SearchParams.NumSimulations << ","
+			<< results.Reward.GetCount() << ","
+			<< results.Reward.GetMean() << ","
+			<< results.Reward.GetStdErr() << ","
+			<< results.Time.GetMean() / results.Reward.GetCount() << endl;
+		OutputFile.flush();
+	});
 }
 
 //----------------------------------------------------------------------------
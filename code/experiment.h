@@ -4,13 +4,17 @@
 #include "mcts.h"
 #include "simulator.h"
 #include "statistic.h"
+#include "threadpool.h"
 #include <fstream>
+#include <functional>
+#include <sstream>
 
 //----------------------------------------------------------------------------
 
 struct RESULTS
 {
 	void Clear();
+	void Merge(const RESULTS& results);
 
 	STATISTIC Time;
 	STATISTIC Reward;
@@ -26,6 +30,14 @@ inline void RESULTS::Clear()
 	UndiscountedReturn.Clear();
 }
 
+inline void RESULTS::Merge(const RESULTS& results)
+{
+	Time.Merge(results.Time);
+	Reward.Merge(results.Reward);
+	DiscountedReturn.Merge(results.DiscountedReturn);
+	UndiscountedReturn.Merge(results.UndiscountedReturn);
+}
+
 //----------------------------------------------------------------------------
 
 class EXPERIMENT
@@ -51,11 +63,13 @@ public:
 		double Accuracy; // smallest precision we care about - used to calculate horizon for discounted tasks
 		int UndiscountedHorizon; // used to calculate the horizon for undiscounted tasks
 		bool AutoExploration; // whether to set the exploration constant by finding a reward range
+		int NumThreads; // number of runs played concurrently, each with its own simulators
 	};
 
 	EXPERIMENT(const SIMULATOR& real, const SIMULATOR& simulator,
 		const std::string& outputFile,
 		EXPERIMENT::PARAMS& expParams, MCTS::PARAMS& searchParams);
+	~EXPERIMENT();
 
 	void Run();
 	void MultiRun();
@@ -64,12 +78,38 @@ public:
 
 private:
 
+	// One simulation budget of a sweep, with its runs merged in run order
+	struct DOUBLING
+	{
+		MCTS::PARAMS SearchParams;
+		int NumRuns;
+		uint64_t Seed;
+		RESULTS Results;
+		std::vector<RESULTS> Runs;
+		std::vector<std::string> Output;
+		std::vector<bool> Done;
+		int NextRun, Remaining;
+		bool TimedOut;
+		std::ostringstream Log;
+	};
+
+	void Run(const SIMULATOR& real, const SIMULATOR& simulator,
+		const MCTS::PARAMS& searchParams, RESULTS& results, std::ostream& ostr);
+	void DisplayRun(const RESULTS& run, const RESULTS& results, std::ostream& ostr) const;
+	void SetDoubling(MCTS::PARAMS& searchParams, int doubling) const;
+	void Sweep(std::vector<DOUBLING>& doublings,
+		const std::function<void(DOUBLING&)>& report);
+
 	const SIMULATOR& Real;
 	const SIMULATOR& Simulator;
 	EXPERIMENT::PARAMS& ExpParams;
 	MCTS::PARAMS& SearchParams;
 	RESULTS Results;
 
+	// Concurrent runs, with clones of the simulators for all threads but the first
+	THREAD_POOL* Pool;
+	std::vector<SIMULATOR*> Reals, Simulators;
+
 	std::ofstream OutputFile;
 };
 
@@ -5,6 +5,7 @@
 #include "rocksample.h"
 #include "tag.h"
 #include "experiment.h"
+#include "coord.h"
 #include <string>
 #include <boost/program_options.hpp>
 
@@ -25,14 +26,25 @@ int main(int argc, char* argv[])
 		("name,n", po::value<string>()->default_value("default"), "set test name")
 		("size,s", po::value<int>()->default_value(10), "set size of problem")
 		("number,num", po::value<int>()->default_value(10), "set number of objects in problem")
+		("seed", po::value<int>()->default_value(0), "set random seed")
 		("experiment_config", po::value<string>()->default_value("experiment_config"), "set experiment config file path")
 		("knowledge_config", po::value<string>()->default_value("knowledge_config"), "set knowledge config file path")
-		("mcts_config", po::value<string>()->default_value("mcts_config"), "set MCTS config file path");
+		("mcts_config", po::value<string>()->default_value("mcts_config"), "set MCTS config file path")
+		("test", "run the unit tests and exit");
 
 	po::variables_map vm;
 	po::store(po::parse_command_line(argc, argv, desc), vm);
 	po::notify(vm);
 
+	if (vm.count("test"))
+	{
+		UTILS::UnitTest();
+		COORD::UnitTest();
+		MCTS::UnitTest();
+		cout << "Unit tests passed" << endl;
+		return 0;
+	}
+
     string testName;
 	int size, number;
 	problem = vm["problem"].as<string>();
@@ -84,6 +96,9 @@ int main(int argc, char* argv[])
 	// add knowledge level
     simulator->SetKnowledge(knowledge);
 
+	// seed after construction, as some problems seed their own layout
+	UTILS::RandomSeed(vm["seed"].as<int>());
+
 	// configure output file
 	if(testName == "default") {
 		outputfile = "/dev/null";
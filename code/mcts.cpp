@@ -1,8 +1,13 @@
 #include "mcts.h"
+#include "planner.h"
+#include "selection.h"
 #include "testsimulator.h"
 #include <math.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <boost/property_tree/json_parser.hpp>
 
 using namespace std;
@@ -24,7 +29,21 @@ MCTS::PARAMS::PARAMS()
 	UseRave(false),
 	RaveDiscount(1.0),
 	RaveConstant(0.01),
-	DisableTree(false)
+	DisableTree(false),
+	Parallel(PARALLEL_NONE),
+	NumThreads(1),
+	BatchSize(16),
+	VirtualLoss(1.0),
+	LeafRollouts(1),
+	Ponder(false),
+	ReuseTree(false),
+	TimeBudget(0),
+	TimeCheckInterval(16),
+	EarlyStop(0),
+	EpisodeBudget(0),
+	BudgetSteps(100),
+	TreeMemory(0),
+	DeferTeardown(false)
 {
 }
 
@@ -49,41 +68,131 @@ MCTS::PARAMS::PARAMS(const std::string& filename) {
     RaveDiscount = pt.get<double>("RaveDiscount");
     RaveConstant = pt.get<double>("RaveConstant");
     DisableTree = pt.get<bool>("DisableTree");
+    Parallel = pt.get<int>("Parallel");
+    NumThreads = pt.get<int>("NumThreads");
+    BatchSize = pt.get<int>("BatchSize");
+    VirtualLoss = pt.get<double>("VirtualLoss");
+    LeafRollouts = pt.get<int>("LeafRollouts");
+    Ponder = pt.get<bool>("Ponder");
+    ReuseTree = pt.get<bool>("ReuseTree");
+    TimeBudget = pt.get<double>("TimeBudget");
+    TimeCheckInterval = pt.get<int>("TimeCheckInterval");
+    EarlyStop = pt.get<double>("EarlyStop");
+    EpisodeBudget = pt.get<double>("EpisodeBudget");
+    BudgetSteps = pt.get<int>("BudgetSteps");
+    TreeMemory = pt.get<double>("TreeMemory");
+    DeferTeardown = pt.get<bool>("DeferTeardown");
 }
 
 MCTS::MCTS(const SIMULATOR& simulator, const PARAMS& params)
 	: Simulator(simulator),
+	TreeDepth(0),
 	Params(params),
-	TreeDepth(0)
+	Master(0),
+	SharedTree(false),
+	Pool(0),
+	Budget(0),
+	Reclaimer(0),
+	PonderStop(false),
+	HasDeadline(false),
+	SearchTime(0),
+	NumEvicted(0)
 {
-	VNODE::NumChildren = Simulator.GetNumActions();
-	QNODE::NumChildren = Simulator.GetNumObservations();
+	// Searches that read statistics the tree was built without
+	assert(VNODE::HasAMAF || !Params.UseRave);
+	assert(VNODE::HasVariance || (Params.EarlyStop <= 0 && Params.EpisodeBudget <= 0));
 
+	Arena = new NODE_ARENA;
 	Root = ExpandNode(Simulator.CreateStartState());
+	NodeBytes = Root->GetBytes();
 
 	for (int i = 0; i < Params.NumStartStates; i++)
 		Root->Beliefs().AddSample(Simulator.CreateStartState());
+
+	if (Params.Parallel != PARAMS::PARALLEL_NONE && Params.NumThreads > 1)
+		Pool = new THREAD_POOL(Params.NumThreads);
+
+	if (Params.EpisodeBudget > 0)
+		Budget = new BUDGET(Params.EpisodeBudget, Params.BudgetSteps);
+
+	if (Params.DeferTeardown)
+		Reclaimer = new RECLAIMER(Simulator, *Arena);
+
+	// Leaf workers only provide a history and status for their rollouts
+	if (Pool && Params.Parallel == PARAMS::PARALLEL_LEAF)
+		for (int i = 0; i < Pool->GetNumThreads(); i++)
+			LeafWorkers.push_back(new MCTS(*this, true));
+}
+
+MCTS::MCTS(const MCTS& master, bool shareTree)
+	: Simulator(master.Simulator),
+	TreeDepth(0),
+	Params(master.Params),
+	Context(master.Context),
+	Master(&master),
+	SharedTree(shareTree),
+	Pool(0),
+	Budget(0),
+	Reclaimer(0),
+	PonderStop(false),
+	HasDeadline(false),
+	SearchTime(0),
+	NodeBytes(master.NodeBytes),
+	NumEvicted(0)
+{
+	// Workers build in the arena of the master, so their nodes can be
+	// merged into its tree
+	Arena = master.Arena;
+	if (SharedTree)
+	{
+		Root = master.Root;
+		return;
+	}
+
+	// Start from the same prior and statistics as the master root
+	Root = ExpandNode(master.BeliefState().GetSample(0));
+	Root->CopyStatistics(*master.Root);
 }
 
 MCTS::~MCTS()
 {
-	VNODE::Free(Root, Simulator);
-	VNODE::FreeAll();
+	StopPondering();
+	for (int i = 0; i < LeafWorkers.size(); i++)
+		delete LeafWorkers[i];
+	delete Pool;
+	delete Budget;
+
+	// Pending subtrees are freed before the arena goes
+	delete Reclaimer;
+	Reclaimer = 0;
+
+	if (SharedTree)
+		return;
+	if (Master)
+	{
+		Arena->Free(Root, Simulator);
+		return;
+	}
+	FreeTree();
+	delete Arena;
 }
 
 bool MCTS::Update(int action, int observation, double reward)
 {
-	History.Add(action, observation);
+	StopPondering();
+	Context.History.Add(action, observation);
 	BELIEF_STATE beliefs;
 
 	// Find matching vnode from the rest of the tree
-	QNODE& qnode = Root->Child(action);
-	VNODE* vnode = qnode.Child(observation);
+	QNODE* qnode = Root->FindChild(action);
+	VNODE* vnode = qnode ? Arena->Get(qnode->Child(observation)) : 0;
+	bool reuse = vnode && (Params.ReuseTree || Params.Ponder);
 	if (vnode)
 	{
 		if (Params.Verbose >= Params.TREE)
 			cout << "Matched " << vnode->Beliefs().GetNumSamples() << " states" << endl;
-		beliefs.Copy(vnode->Beliefs(), Simulator);
+		if (!reuse)
+			beliefs.Copy(vnode->Beliefs(), Simulator);
 	}
 	else
 	{
@@ -99,6 +208,23 @@ bool MCTS::Update(int action, int observation, double reward)
 	if (beliefs.Empty() && (!vnode || vnode->Beliefs().Empty()))
 		return false;
 
+	// Keep the matched subtree and its statistics as the new root,
+	// its particles joined by the transforms, and free only its siblings,
+	// in the background when teardown is deferred
+	if (reuse)
+	{
+		qnode->SetChild(observation, 0);
+		if (Reclaimer)
+			Reclaimer->Free(Root);
+		else
+			Arena->Free(Root, Simulator);
+		vnode->Beliefs().Move(beliefs);
+		Root = vnode;
+		if (Params.Verbose >= Params.TREE)
+			Simulator.DisplayBeliefs(Root->Beliefs(), cout);
+		return true;
+	}
+
 	if (Params.Verbose >= Params.TREE)
 		Simulator.DisplayBeliefs(beliefs, cout);
 
@@ -109,34 +235,113 @@ bool MCTS::Update(int action, int observation, double reward)
 	else
 		state = beliefs.GetSample(0);
 
-	// Delete old tree and create new root
-	VNODE::Free(Root, Simulator);
-	VNODE* newRoot = ExpandNode(state);
+	// Delete old tree and create new root, the prior state may belong to it
+	STATE* prior = Simulator.Copy(*state);
+	FreeTree();
+	VNODE* newRoot = ExpandNode(prior);
 	newRoot->Beliefs() = beliefs;
 	Root = newRoot;
+	Simulator.FreeState(prior);
 	return true;
 }
 
+void MCTS::FreeTree()
+{
+	// Subtrees still being torn down hold handles that must not return
+	// to the arena after it is reset
+	if (Reclaimer)
+		Reclaimer->Wait();
+
+	// Only the root and its children hold particles, every node is then
+	// dropped at once without walking the tree
+	for (int action = 0; action < Root->GetNumChildren(); action++)
+	{
+		const CHILD_MAP& children = Root->Child(action).GetChildren();
+		for (int slot = 0; slot < children.GetNumSlots(); slot++)
+			if (children.GetChild(slot))
+				FreeBeliefs(Arena->Get(children.GetChild(slot))->Beliefs());
+	}
+	FreeBeliefs(Root->Beliefs());
+	Arena->Reset();
+	Root = 0;
+}
+
+void MCTS::FreeBeliefs(BELIEF_STATE& beliefs)
+{
+	if (Reclaimer)
+		Reclaimer->Free(beliefs);
+	else
+		beliefs.Free(Simulator);
+}
+
 int MCTS::SelectAction()
 {
 	if (Params.DisableTree)
 		RolloutSearch();
+	else if (Budget)
+		BudgetedSearch();
 	else
 		UCTSearch();
-	return GreedyUCB(Root, false);
+	return Commit();
+}
+
+void MCTS::StartPondering(int action)
+{
+	StopPondering();
+	AtomicStore(PonderStop, false);
+	PonderThread = thread(&MCTS::Ponder, this, action);
+}
+
+void MCTS::StopPondering()
+{
+	if (!PonderThread.joinable())
+		return;
+	AtomicStore(PonderStop, true);
+	PonderThread.join();
+	if (Params.Verbose >= Params.TREE)
+		StatPonderSimulations.Print("Pondered simulations", cout);
+}
+
+void MCTS::Ponder(int action)
+{
+	// While the environment steps, simulate the selected action from the
+	// root beliefs, growing the subtrees of all its observations.
+	// Bounded by one search budget, to bound the memory used.
+	int historyDepth = Context.History.Size();
+	int n;
+	for (n = 0; n < Params.NumSimulations && !AtomicLoad(PonderStop); n++)
+	{
+		STATE* state = Root->Beliefs().CreateSample(Simulator);
+		Simulator.Validate(*state);
+		Context.Status.Phase = SIMULATOR::STATUS::TREE;
+		TreeDepth = 0;
+		PeakTreeDepth = 0;
+
+		double totalReward = SimulateQ(*state, Root, action);
+		Root->Value.Add(totalReward);
+		AddRave(Root, totalReward);
+
+		Simulator.FreeState(state);
+		Context.History.Truncate(historyDepth);
+	}
+	StatPonderSimulations.Add(n);
 }
 
 void MCTS::RolloutSearch()
 {
 	std::vector<double> totals(Simulator.GetNumActions(), 0.0);
-	int historyDepth = History.Size();
+	int historyDepth = Context.History.Size();
 	std::vector<int> legal;
 	assert(BeliefState().GetNumSamples() > 0);
 	Simulator.GenerateLegal(*BeliefState().GetSample(0), GetHistory(), legal, GetStatus());
-	random_shuffle(legal.begin(), legal.end());
+	Shuffle(legal);
+	StartClock();
 
-	for (int i = 0; i < Params.NumSimulations; i++)
+	int i;
+	for (i = 0; Params.TimeBudget > 0 || i < Params.NumSimulations; i++)
 	{
+		if (i % Params.TimeCheckInterval == 0 && TimeUp())
+			break;
 		int action = legal[i % legal.size()];
 		STATE* state = Root->Beliefs().CreateSample(Simulator);
 		Simulator.Validate(*state);
@@ -145,33 +350,273 @@ void MCTS::RolloutSearch()
 		double immediateReward, delayedReward, totalReward;
 		bool terminal = Simulator.Step(*state, action, observation, immediateReward);
 
-		VNODE*& vnode = Root->Child(action).Child(observation);
-		if (!vnode && !terminal)
+		QNODE& qnode = Root->Child(action, *Arena);
+		if (!qnode.Child(observation) && !terminal)
 		{
-			vnode = ExpandNode(state);
+			VNODE* vnode = ExpandNode(state);
 			AddSample(vnode, *state);
+			qnode.SetChild(observation, vnode->GetHandle());
 		}
-		History.Add(action, observation);
+		Context.History.Add(action, observation);
 
 		delayedReward = Rollout(*state);
 		totalReward = immediateReward + Simulator.GetDiscount() * delayedReward;
-		Root->Child(action).Value.Add(totalReward);
+		Root->ActionValue(action).Add(totalReward);
 
 		Simulator.FreeState(state);
-		History.Truncate(historyDepth);
+		Context.History.Truncate(historyDepth);
+	}
+	StatSimulations.Add(i);
+}
+
+void MCTS::BudgetedSearch()
+{
+	// One search, sized first by the uncertainty of the beliefs, then
+	// extended while the root value leaves the best action in doubt.
+	// The budget sets the length of each slice, not TimeBudget.
+	BeginSearch();
+	HasDeadline = false;
+	double share = Budget->Share(Simulator.BeliefEntropy(BeliefState()));
+	double used = SearchFor(share);
+	double extension = Budget->Extend(share, RootUncertainty());
+	if (extension > 0)
+		used += SearchFor(extension);
+	EndSearch();
+	Budget->Spend(used);
+
+	if (Params.Verbose >= Params.TREE)
+		cout << "Budget step " << Budget->GetStep() << ": used " << used
+			<< ", remaining " << Budget->GetRemaining() << endl;
+}
+
+double MCTS::SearchFor(double amount)
+{
+	// Advance the current search by amount in its units, returning what
+	// was used
+	if (Params.TimeBudget > 0)
+	{
+		if (amount < 1e-3)
+			return 0;
+		double searchTime = SearchTime;
+		AdvanceFor(amount * 1000);
+		return (SearchTime - searchTime) * 1000;
+	}
+	if ((int)amount == 0)
+		return 0;
+	return Advance((int)amount);
+}
+
+double MCTS::RootUncertainty() const
+{
+	// Chance-like overlap between the best and second best root actions:
+	// the standard error of their difference relative to the gap plus error
+	int best = -1, second = -1;
+	for (int action = 0; action < Simulator.GetNumActions(); action++)
+	{
+		const VNODE::ACTION_VALUE value = Root->ActionValue(action);
+		if (value.GetCount() == 0 || value.GetValue() == -Infinity)
+			continue;
+		if (best < 0 || value.GetValue() > Root->ActionValue(best).GetValue())
+		{
+			second = best;
+			best = action;
+		}
+		else if (second < 0 || value.GetValue() > Root->ActionValue(second).GetValue())
+			second = action;
 	}
+	if (second < 0)
+		return best < 0 ? 1 : 0;
+
+	const VNODE::ACTION_VALUE bestValue = Root->ActionValue(best);
+	const VNODE::ACTION_VALUE secondValue = Root->ActionValue(second);
+	double gap = bestValue.GetValue() - secondValue.GetValue();
+	double error = sqrt(bestValue.GetVariance() / bestValue.GetCount()
+		+ secondValue.GetVariance() / secondValue.GetCount());
+	if (gap + error <= 0)
+		return 1;
+	return error / (gap + error);
+}
+
+void MCTS::StartClock()
+{
+	HasDeadline = Params.TimeBudget > 0;
+	Deadline = chrono::steady_clock::now()
+		+ chrono::microseconds((long long)(Params.TimeBudget * 1000));
+}
+
+bool MCTS::TimeUp() const
+{
+	if (Master)
+		return Master->TimeUp();
+	return HasDeadline && chrono::steady_clock::now() >= Deadline;
+}
+
+bool MCTS::Settled(int remaining) const
+{
+	// The greedy root action is settled when no other action can overtake
+	// it. EarlyStop is a z-score multiplier: the best action is bounded
+	// below by its mean less EarlyStop standard errors. Each other action
+	// is bounded above by its mean plus EarlyStop standard errors, or by
+	// its mean if every remaining simulation returned EarlyStop standard
+	// deviations above it, whichever is lower
+	if (Params.EarlyStop <= 0)
+		return false;
+
+	int best = -1;
+	double bestq = -Infinity;
+	for (int action = 0; action < Simulator.GetNumActions(); action++)
+	{
+		const VNODE::ACTION_VALUE value = Root->ActionValue(action);
+		double q = value.GetValue();
+		if (q == -Infinity)
+			continue; // ruled out by prior knowledge
+		if (value.GetCount() < 2)
+			return false;
+		if (q > bestq)
+		{
+			best = action;
+			bestq = q;
+		}
+	}
+	if (best < 0)
+		return false;
+
+	const VNODE::ACTION_VALUE bestValue = Root->ActionValue(best);
+	double lower = bestq - Params.EarlyStop
+		* sqrt(bestValue.GetVariance() / bestValue.GetCount());
+	for (int action = 0; action < Simulator.GetNumActions(); action++)
+	{
+		const VNODE::ACTION_VALUE value = Root->ActionValue(action);
+		double q = value.GetValue();
+		if (action == best || q == -Infinity)
+			continue;
+		int n = value.GetCount();
+		double shift = min(1.0 / sqrt(n), (double)remaining / (n + remaining));
+		double upper = q + Params.EarlyStop * sqrt(value.GetVariance()) * shift;
+		if (upper >= lower)
+			return false;
+	}
+	return true;
 }
 
 void MCTS::UCTSearch()
 {
+	BeginSearch();
+	Advance(Params.TimeBudget > 0 ? INT_MAX : Params.NumSimulations);
+	EndSearch();
+}
+
+void MCTS::BeginSearch()
+{
+	StopPondering();
 	ClearStatistics();
-	int historyDepth = History.Size();
+	SearchTime = 0;
+	NumEvicted = 0;
+	StartClock();
+	if (Pool)
+		Pool->ClearCounters();
+}
+
+int MCTS::Advance(int numSimulations)
+{
+	// Continue the search in the current tree, using the parallel scheme
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	int numDone = StatTotalReward.GetCount();
+
+	// Parallel searches only evict between their calls, never while
+	// workers are in the tree
+	Prune();
+	if (Pool && Params.Parallel == PARAMS::PARALLEL_ROOT)
+		RootParallelSearch(numSimulations);
+	else if (Pool && Params.Parallel == PARAMS::PARALLEL_TREE)
+		TreeParallelSearch(numSimulations);
+	else
+		UCTSimulations(numSimulations);
+	Prune();
 
-	for (int n = 0; n < Params.NumSimulations; n++)
+	for (int i = 0; i < LeafWorkers.size(); i++)
 	{
-		STATE* state = Root->Beliefs().CreateSample(Simulator);
+		StatRolloutDepth.Merge(LeafWorkers[i]->StatRolloutDepth);
+		LeafWorkers[i]->StatRolloutDepth.Clear();
+	}
+
+	SearchTime += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return StatTotalReward.GetCount() - numDone;
+}
+
+int MCTS::AdvanceFor(double microseconds)
+{
+	// Stop at the end of the slice, or at the search deadline if sooner
+	bool hasDeadline = HasDeadline;
+	chrono::steady_clock::time_point deadline = Deadline;
+	chrono::steady_clock::time_point end = chrono::steady_clock::now()
+		+ chrono::microseconds((long long)microseconds);
+	if (!HasDeadline || end < Deadline)
+		Deadline = end;
+	HasDeadline = true;
+
+	int numDone = Advance(INT_MAX);
+	HasDeadline = hasDeadline;
+	Deadline = deadline;
+	return numDone;
+}
+
+int MCTS::CurrentBestAction()
+{
+	return GreedyUCB(Root, false);
+}
+
+double MCTS::CurrentValue() const
+{
+	// Value of the greedy action, or the prior value before any simulation
+	double bestq = -Infinity;
+	for (int action = 0; action < Simulator.GetNumActions(); action++)
+		bestq = max(bestq, Root->ActionValue(action).GetValue());
+	return bestq;
+}
+
+int MCTS::CommitSearch()
+{
+	EndSearch();
+	return Commit();
+}
+
+void MCTS::EndSearch()
+{
+	int numSimulations = StatTotalReward.GetCount();
+	StatSimulations.Add(numSimulations);
+	if (Params.TimeBudget <= 0 && !Budget)
+		StatUnusedSimulations.Add(max(Params.NumSimulations - numSimulations, 0));
+	StatSearchTime.Add(SearchTime);
+	StatEvictions.Add(NumEvicted);
+	DisplayStatistics(cout);
+}
+
+int MCTS::Commit()
+{
+	int action = GreedyUCB(Root, false);
+	if (Params.Ponder && !Params.DisableTree)
+		StartPondering(action);
+	return action;
+}
+
+void MCTS::UCTSimulations(int numSimulations)
+{
+	int historyDepth = Context.History.Size();
+	const BELIEF_STATE& beliefs = Master ? Master->BeliefState() : BeliefState();
+
+	for (int n = 0; n < numSimulations; n++)
+	{
+		if (n % Params.TimeCheckInterval == 0)
+		{
+			if (TimeUp() || (!Master && Settled(numSimulations - n)))
+				break;
+			if (!Master)
+				Prune();
+		}
+		STATE* state = beliefs.CreateSample(Simulator);
 		Simulator.Validate(*state);
-		Status.Phase = SIMULATOR::STATUS::TREE;
+		Context.Status.Phase = SIMULATOR::STATUS::TREE;
 		if (Params.Verbose >= Params.RESULT)
 		{
 			cout << "Starting simulation" << endl;
@@ -190,10 +635,245 @@ void MCTS::UCTSearch()
 			DisplayValue(4, cout);
 
 		Simulator.FreeState(state);
-		History.Truncate(historyDepth);
+		Context.History.Truncate(historyDepth);
 	}
+}
 
-	DisplayStatistics(cout);
+void MCTS::RootParallelSearch(int numSimulations)
+{
+	// Workers start from the statistics of the root before the search,
+	// and only what they add is merged back
+	ROOT_STATISTICS base;
+	base.Value = Root->Value;
+	base.ActionValues = Root->GetActionValues();
+	base.ActionAMAFs = Root->GetActionAMAFs();
+
+	// Each scheduler thread searches its own tree
+	vector<MCTS*> workers;
+	for (int i = 0; i < Pool->GetNumThreads(); i++)
+		workers.push_back(new MCTS(*this));
+	ScheduleSimulations(workers, numSimulations);
+
+	for (int i = 0; i < workers.size(); i++)
+	{
+		MergeRoot(*workers[i], base);
+		delete workers[i];
+	}
+}
+
+void MCTS::TreeParallelSearch(int numSimulations)
+{
+	// All scheduler threads search the root tree
+	vector<MCTS*> workers;
+	for (int i = 0; i < Pool->GetNumThreads(); i++)
+		workers.push_back(new MCTS(*this, true));
+	ScheduleSimulations(workers, numSimulations);
+
+	for (int i = 0; i < workers.size(); i++)
+	{
+		StatTreeDepth.Merge(workers[i]->StatTreeDepth);
+		StatRolloutDepth.Merge(workers[i]->StatRolloutDepth);
+		StatTotalReward.Merge(workers[i]->StatTotalReward);
+		delete workers[i];
+	}
+}
+
+void MCTS::ScheduleSimulations(const vector<MCTS*>& workers, int numSimulations)
+{
+	// Each batch has its own random stream so the batch is reproducible
+	RANDOM& random = RANDOM::Thread();
+	uint64_t seed = random.Next();
+	RANDOM saved = random;
+
+	// Separate trees each run their own share of the batches in order,
+	// batch b in tree b % numTrees, so the search is the same for a seed
+	// however the threads are scheduled
+	if (!workers[0]->SharedTree)
+	{
+		int numTrees = workers.size();
+		Pool->Run(numTrees, [&](int tree, int thread)
+		{
+			for (int batch = tree; (long long)batch * Params.BatchSize < numSimulations
+				&& !TimeUp(); batch += numTrees)
+			{
+				RANDOM::Thread().Seed(seed, batch);
+				workers[tree]->UCTSimulations(min(Params.BatchSize,
+					numSimulations - batch * Params.BatchSize));
+			}
+		});
+		random = saved;
+		return;
+	}
+
+	// A shared tree is searched by whichever thread picks up each batch,
+	// and the remaining batches are skipped once the root action is settled
+	atomic<int> numDone(0);
+	bool settled = false;
+	auto stop = [&]()
+	{
+		if (AtomicLoad(settled))
+			return true;
+		int remaining = HasDeadline ? INT_MAX : numSimulations - numDone;
+		if (Settled(remaining))
+			AtomicStore(settled, true);
+		return AtomicLoad(settled);
+	};
+
+	if (HasDeadline)
+	{
+		// Batches are handed out until the deadline passes
+		atomic<int> nextBatch(0);
+		Pool->Run(Pool->GetNumThreads(), [&](int task, int thread)
+		{
+			while (!TimeUp() && !stop())
+			{
+				int batch = nextBatch++;
+				if ((long long)batch * Params.BatchSize >= numSimulations)
+					break;
+				RANDOM::Thread().Seed(seed, batch);
+				workers[thread]->UCTSimulations(min(Params.BatchSize,
+					numSimulations - batch * Params.BatchSize));
+			}
+		});
+		random = saved;
+		return;
+	}
+
+	int numBatches = (numSimulations + Params.BatchSize - 1) / Params.BatchSize;
+	Pool->Run(numBatches, [&](int batch, int thread)
+	{
+		if (stop())
+			return;
+		RANDOM::Thread().Seed(seed, batch);
+		int batchSize = min(Params.BatchSize,
+			numSimulations - batch * Params.BatchSize);
+		workers[thread]->UCTSimulations(batchSize);
+		numDone += batchSize;
+	});
+	random = saved;
+}
+
+size_t MCTS::GetTreeBytes() const
+{
+	// Nodes are counted at the size they are expanded with, as particles
+	// and larger child maps are rare away from the root, along with the
+	// QNODEs of the actions tried from them
+	return Arena->GetNumAllocated() * NodeBytes + Arena->GetNumChildren() * sizeof(QNODE);
+}
+
+void MCTS::Prune()
+{
+	if (Params.TreeMemory <= 0)
+		return;
+	double limit = Params.TreeMemory * 1048576.0;
+	if (GetTreeBytes() <= limit)
+		return;
+	assert(!Master);
+
+	// Subtrees still being torn down count until they are freed
+	if (Reclaimer)
+	{
+		Reclaimer->Wait();
+		if (GetTreeBytes() <= limit)
+			return;
+	}
+
+	// Evict down to three quarters of the limit, so that search continues
+	// for a while before the next eviction
+	struct CANDIDATE
+	{
+		int Count, Depth;
+		QNODE* Parent;
+		int Observation;
+		VNODE* Node;
+
+		bool operator<(const CANDIDATE& other) const
+		{
+			if (Count != other.Count)
+				return Count < other.Count;
+			return Depth > other.Depth;
+		}
+	};
+
+	// The root and its children hold the particles and are always kept.
+	// A node is visited no more often than its parent, so ordering by
+	// visits, then deepest first, evicts children before their parents
+	vector<CANDIDATE> candidates;
+	vector<pair<VNODE*, int> > open(1, make_pair(Root, 0));
+	while (!open.empty())
+	{
+		VNODE* vnode = open.back().first;
+		int depth = open.back().second;
+		open.pop_back();
+		for (int action = 0; action < vnode->GetNumChildren(); action++)
+		{
+			QNODE* qnode = vnode->FindChild(action);
+			if (!qnode)
+				continue;
+			const CHILD_MAP& children = qnode->GetChildren();
+			for (int slot = 0; slot < children.GetNumSlots(); slot++)
+			{
+				VNODE* child = Arena->Get(children.GetChild(slot));
+				if (!child)
+					continue;
+				if (depth > 0)
+				{
+					CANDIDATE candidate = { child->Value.GetCount(), depth + 1,
+						qnode, children.GetObservation(slot), child };
+					candidates.push_back(candidate);
+				}
+				open.push_back(make_pair(child, depth + 1));
+			}
+		}
+	}
+	sort(candidates.begin(), candidates.end());
+
+	for (int i = 0; i < candidates.size() && GetTreeBytes() > 0.75 * limit; i++)
+	{
+		candidates[i].Parent->SetChild(candidates[i].Observation, 0);
+		Arena->Free(candidates[i].Node, Simulator);
+		NumEvicted++;
+	}
+}
+
+void MCTS::MergeRoot(const MCTS& worker, const ROOT_STATISTICS& base)
+{
+	// Root statistics are merged, depth one nodes keep their particles
+	VNODE* root = worker.Root;
+	for (int action = 0; action < Simulator.GetNumActions(); action++)
+	{
+		QNODE* wqnode = root->FindChild(action);
+		const CHILD_MAP& children = wqnode ? wqnode->GetChildren() : QNODE::Untried().GetChildren();
+		for (int slot = 0; slot < children.GetNumSlots(); slot++)
+		{
+			VNODE* wvnode = Arena->Get(children.GetChild(slot));
+			if (!wvnode)
+				continue;
+			QNODE& qnode = Root->Child(action, *Arena);
+			int observation = children.GetObservation(slot);
+			VNODE* vnode = Arena->Get(qnode.Child(observation));
+			if (!vnode)
+			{
+				qnode.SetChild(observation, wvnode->GetHandle());
+				wqnode->SetChild(observation, 0);
+			}
+			else
+			{
+				VALUE<int> empty;
+				empty.Set(0, 0);
+				vnode->Value.Merge(wvnode->Value, empty);
+				vnode->Beliefs().Move(wvnode->Beliefs());
+			}
+		}
+		Root->ActionValue(action).Merge(root->ActionValue(action), base.ActionValues[action]);
+		if (VNODE::HasAMAF)
+			Root->ActionAMAF(action).Merge(root->ActionAMAF(action), base.ActionAMAFs[action]);
+	}
+	Root->Value.Merge(root->Value, base.Value);
+
+	StatTreeDepth.Merge(worker.StatTreeDepth);
+	StatRolloutDepth.Merge(worker.StatRolloutDepth);
+	StatTotalReward.Merge(worker.StatTotalReward);
 }
 
 double MCTS::SimulateV(STATE& state, VNODE* vnode)
@@ -207,15 +887,25 @@ double MCTS::SimulateV(STATE& state, VNODE* vnode)
 	if (TreeDepth == 1)
 		AddSample(vnode, state);
 
-	QNODE& qnode = vnode->Child(action);
-	double totalReward = SimulateQ(state, qnode, action);
-	vnode->Value.Add(totalReward);
+	VNODE::ACTION_VALUE value = vnode->ActionValue(action);
+	if (SharedTree)
+		value.AddVirtualLoss(Params.VirtualLoss);
+	double totalReward = SimulateQ(state, vnode, action);
+	if (SharedTree)
+	{
+		value.RemoveVirtualLoss(Params.VirtualLoss);
+		vnode->Value.AddShared(totalReward);
+	}
+	else
+		vnode->Value.Add(totalReward);
 	AddRave(vnode, totalReward);
 	return totalReward;
 }
 
-double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action)
+double MCTS::SimulateQ(STATE& state, VNODE* parent, int action)
 {
+	QNODE& qnode = parent->Child(action, *Arena);
+	VNODE::ACTION_VALUE value = parent->ActionValue(action);
 	int observation;
 	double immediateReward, delayedReward = 0;
 
@@ -223,7 +913,7 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action)
 		Simulator.UpdateAlpha(qnode, state);
 	bool terminal = Simulator.Step(state, action, observation, immediateReward);
 	assert(observation >= 0 && observation < Simulator.GetNumObservations());
-	History.Add(action, observation);
+	Context.History.Add(action, observation);
 
 	if (Params.Verbose >= Params.SIMULATION)
 	{
@@ -233,9 +923,11 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action)
 		Simulator.DisplayState(state, cout);
 	}
 
-	VNODE*& vnode = qnode.Child(observation);
-	if (!vnode && !terminal && qnode.Value.GetCount() >= Params.ExpandCount)
-		vnode = ExpandNode(&state);
+	// In a shared tree this visit is already counted by its virtual loss
+	int count = value.GetCount() - (SharedTree ? 1 : 0);
+	VNODE* vnode = Arena->Get(qnode.Child(observation));
+	if (!vnode && !terminal && count >= Params.ExpandCount)
+		vnode = Expand(qnode, observation, state);
 
 	if (!terminal)
 	{
@@ -243,46 +935,78 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action)
 		if (vnode)
 			delayedReward = SimulateV(state, vnode);
 		else
-			delayedReward = Rollout(state);
+			delayedReward = LeafRollout(state);
 		TreeDepth--;
 	}
 
 	double totalReward = immediateReward + Simulator.GetDiscount() * delayedReward;
-	qnode.Value.Add(totalReward);
+	if (SharedTree)
+		value.AddShared(totalReward);
+	else
+		value.Add(totalReward);
 	return totalReward;
 }
 
 void MCTS::AddRave(VNODE* vnode, double totalReward)
 {
+	if (!VNODE::HasAMAF)
+		return;
+
 	double totalDiscount = 1.0;
-	for (int t = TreeDepth; t < History.Size(); ++t)
+	for (int t = TreeDepth; t < Context.History.Size(); ++t)
 	{
-		QNODE& qnode = vnode->Child(History[t].Action);
-		qnode.AMAF.Add(totalReward, totalDiscount);
+		VNODE::ACTION_AMAF amaf = vnode->ActionAMAF(Context.History[t].Action);
+		if (SharedTree)
+			amaf.AddShared(totalReward, totalDiscount);
+		else
+			amaf.Add(totalReward, totalDiscount);
 		totalDiscount *= Params.RaveDiscount;
 	}
 }
 
 VNODE* MCTS::ExpandNode(const STATE* state)
 {
-	VNODE* vnode = VNODE::Create();
+	VNODE* vnode = Arena->Create(Simulator.GetNumActions());
 	vnode->Value.Set(0, 0);
-	Simulator.Prior(state, History, vnode, Status);
+	Simulator.Prior(state, Context, vnode);
 
 	if (Params.Verbose >= Params.RESULT)
 	{
 		cout << "Expanding node: ";
-		History.Display(cout);
+		Context.History.Display(cout);
 		cout << endl;
 	}
 
 	return vnode;
 }
 
+VNODE* MCTS::Expand(QNODE& qnode, int observation, const STATE& state)
+{
+	VNODE* vnode = ExpandNode(&state);
+	if (!SharedTree)
+	{
+		qnode.SetChild(observation, vnode->GetHandle());
+		return vnode;
+	}
+
+	// Publish the fully expanded node, unless another thread got there first
+	NODE_HANDLE published = qnode.PublishChild(observation, vnode->GetHandle());
+	if (published == vnode->GetHandle())
+		return vnode;
+	Arena->Discard(vnode);
+	return Arena->Get(published);
+}
+
 void MCTS::AddSample(VNODE* node, const STATE& state)
 {
 	STATE* sample = Simulator.Copy(state);
-	node->Beliefs().AddSample(sample);
+	if (SharedTree)
+	{
+		lock_guard<SPIN_LOCK> lock(node->BeliefsLock());
+		node->Beliefs().AddSample(sample);
+	}
+	else
+		node->Beliefs().AddSample(sample);
 	if (Params.Verbose >= Params.RESULT)
 	{
 		cout << "Adding sample:" << endl;
@@ -290,58 +1014,62 @@ void MCTS::AddSample(VNODE* node, const STATE& state)
 	}
 }
 
-int MCTS::GreedyUCB(VNODE* vnode, bool ucb) const
+int MCTS::GreedyUCB(VNODE* vnode, bool ucb)
 {
-	static vector<int> besta;
-	besta.clear();
-	double bestq = -Infinity;
+	vector<int>& besta = Context.BestActions;
 	int N = vnode->Value.GetCount();
-	double logN = log(N + 1);
-	bool hasalpha = Simulator.HasAlpha();
+	int numActions = Simulator.GetNumActions();
 
-	for (int action = 0; action < Simulator.GetNumActions(); action++)
+	SELECTION::INPUT input;
+	input.NumActions = numActions;
+	double* widened = 0;
+	if (sizeof(VNODE::ACCUMULATOR) != sizeof(double))
 	{
-		double q, alphaq;
-		int n, alphan;
-
-		QNODE& qnode = vnode->Child(action);
-		q = qnode.Value.GetValue();
-		n = qnode.Value.GetCount();
-
-		if (Params.UseRave && qnode.AMAF.GetCount() > 0)
-		{
-			double n2 = qnode.AMAF.GetCount();
-			double beta = n2 / (n + n2 + Params.RaveConstant * n * n2);
-			q = (1.0 - beta) * q + beta * qnode.AMAF.GetValue();
-		}
-
-		if (hasalpha && n > 0)
-		{
-			Simulator.AlphaValue(qnode, alphaq, alphan);
-			q = (n * q + alphan * alphaq) / (n + alphan);
-			//cout << "N = " << n << ", alphaN = " << alphan << endl;
-			//cout << "Q = " << q << ", alphaQ = " << alphaq << endl;
-		}
+		Context.Widened.resize(3 * numActions);
+		widened = &Context.Widened[0];
+	}
+	input.Counts = vnode->GetActionValues().GetCounts();
+	input.Totals = SELECTION::Widen(vnode->GetActionValues().GetTotals(),
+		numActions, widened, SharedTree);
+	if (Params.UseRave)
+	{
+		input.AMAFCounts = SELECTION::Widen(vnode->GetActionAMAFs().GetCounts(),
+			numActions, widened ? widened + numActions : 0, SharedTree);
+		input.AMAFTotals = SELECTION::Widen(vnode->GetActionAMAFs().GetTotals(),
+			numActions, widened ? widened + 2 * numActions : 0, SharedTree);
+		input.RaveConstant = Params.RaveConstant;
+	}
 
-		if (ucb)
-			q += FastUCB(N, n, logN);
+	if (Simulator.HasAlpha())
+	{
+		vector<double>& alphaValues = Context.AlphaValues;
+		vector<int>& alphaCounts = Context.AlphaCounts;
+		alphaValues.resize(numActions);
+		alphaCounts.resize(numActions);
+		for (int action = 0; action < numActions; action++)
+			Simulator.AlphaValue(vnode->Child(action), alphaValues[action], alphaCounts[action]);
+		input.AlphaValues = &alphaValues[0];
+		input.AlphaCounts = &alphaCounts[0];
+	}
 
-		if (q >= bestq)
-		{
-			if (q > bestq)
-				besta.clear();
-			bestq = q;
-			besta.push_back(action);
-		}
+	input.Exploration = ucb;
+	if (InitialisedFastUCB && N < UCB_N)
+	{
+		input.Table = UCB[N];
+		input.TableSize = UCB_n;
 	}
+	input.ExplorationConstant = Params.ExplorationConstant;
+	input.LogN = log(N + 1);
+	input.Shared = SharedTree;
 
+	SELECTION::Select(input, Context.Scores, besta);
 	assert(!besta.empty());
 	return besta[Random(besta.size())];
 }
 
 double MCTS::Rollout(STATE& state)
 {
-	Status.Phase = SIMULATOR::STATUS::ROLLOUT;
+	Context.Status.Phase = SIMULATOR::STATUS::ROLLOUT;
 	if (Params.Verbose >= Params.SIMULATION)
 		cout << "Starting rollout" << endl;
 
@@ -354,9 +1082,9 @@ double MCTS::Rollout(STATE& state)
 		int observation;
 		double reward;
 
-		int action = Simulator.SelectRandom(state, History, Status);
+		int action = Simulator.SelectRandom(state, Context);
 		terminal = Simulator.Step(state, action, observation, reward);
-		History.Add(action, observation);
+		Context.History.Add(action, observation);
 
 		if (Params.Verbose >= Params.ROLLOUT)
 		{
@@ -377,6 +1105,38 @@ double MCTS::Rollout(STATE& state)
 	return totalReward;
 }
 
+double MCTS::LeafRollout(STATE& state)
+{
+	if (LeafWorkers.empty() || Params.LeafRollouts <= 1)
+		return Rollout(state);
+
+	// Mean of independent rollouts from copies of the leaf state,
+	// each with its own random stream
+	Context.Status.Phase = SIMULATOR::STATUS::ROLLOUT;
+	RANDOM& random = RANDOM::Thread();
+	uint64_t seed = random.Next();
+	RANDOM saved = random;
+
+	vector<double> rewards(Params.LeafRollouts);
+	Pool->Run(Params.LeafRollouts, [&](int rollout, int thread)
+	{
+		RANDOM::Thread().Seed(seed, rollout);
+		MCTS& worker = *LeafWorkers[thread];
+		worker.Context.History = Context.History;
+		worker.Context.Status = Context.Status;
+		worker.TreeDepth = TreeDepth;
+		STATE* copy = Simulator.Copy(state);
+		rewards[rollout] = worker.Rollout(*copy);
+		Simulator.FreeState(copy);
+	});
+	random = saved;
+
+	double totalReward = 0.0;
+	for (int rollout = 0; rollout < Params.LeafRollouts; rollout++)
+		totalReward += rewards[rollout];
+	return totalReward / Params.LeafRollouts;
+}
+
 void MCTS::AddTransforms(VNODE* root, BELIEF_STATE& beliefs)
 {
 	int attempts = 0, added = 0;
@@ -406,15 +1166,15 @@ STATE* MCTS::CreateTransform() const
 	double stepReward;
 
 	STATE* state = Root->Beliefs().CreateSample(Simulator);
-	Simulator.Step(*state, History.Back().Action, stepObs, stepReward);
-	if (Simulator.LocalMove(*state, History, stepObs, Status))
+	Simulator.Step(*state, Context.History.Back().Action, stepObs, stepReward);
+	if (Simulator.LocalMove(*state, Context.History, stepObs, Context.Status))
 		return state;
 	Simulator.FreeState(state);
 	return 0;
 }
 
 double MCTS::UCB[UCB_N][UCB_n];
-bool MCTS::InitialisedFastUCB = true;
+bool MCTS::InitialisedFastUCB = false;
 
 void MCTS::InitFastUCB(double exploration)
 {
@@ -429,22 +1189,16 @@ void MCTS::InitFastUCB(double exploration)
 	InitialisedFastUCB = true;
 }
 
-inline double MCTS::FastUCB(int N, int n, double logN) const
-{
-	if (InitialisedFastUCB && N < UCB_N && n < UCB_n)
-		return UCB[N][n];
-
-	if (n == 0)
-		return Infinity;
-	else
-		return Params.ExplorationConstant * sqrt(logN / n);
-}
-
 void MCTS::ClearStatistics()
 {
 	StatTreeDepth.Clear();
 	StatRolloutDepth.Clear();
 	StatTotalReward.Clear();
+	StatSearchTime.Clear();
+	StatPonderSimulations.Clear();
+	StatSimulations.Clear();
+	StatUnusedSimulations.Clear();
+	StatEvictions.Clear();
 }
 
 void MCTS::DisplayStatistics(ostream& ostr) const
@@ -454,13 +1208,32 @@ void MCTS::DisplayStatistics(ostream& ostr) const
 		StatTreeDepth.Print("Tree depth", ostr);
 		StatRolloutDepth.Print("Rollout depth", ostr);
 		StatTotalReward.Print("Total reward", ostr);
+		StatSearchTime.Print("Search time", ostr);
+		StatSimulations.Print("Simulations", ostr);
+		StatUnusedSimulations.Print("Unused simulations", ostr);
+		if (Params.TreeMemory > 0)
+		{
+			StatEvictions.Print("Evicted nodes", ostr);
+			ostr << "Tree memory: " << GetTreeBytes() / 1048576.0 << " MB in "
+				<< Arena->GetNumAllocated() << " nodes" << endl;
+		}
+		ostr << "Simulations per second with " << Params.NumThreads << " threads: "
+			<< StatSimulations.GetTotal() / StatSearchTime.GetTotal() << endl;
+		if (Pool)
+		{
+			THREAD_POOL::COUNTERS counters = Pool->GetTotalCounters();
+			ostr << "Scheduler: " << counters.Tasks << " tasks, "
+				<< counters.Steals << " steals, "
+				<< 100 * counters.IdleTime / (counters.BusyTime + counters.IdleTime)
+				<< "% idle" << endl;
+		}
 	}
 
 	if (Params.Verbose >= Params.RESULT)
 	{
-		ostr << "Policy after " << Params.NumSimulations << " simulations" << endl;
+		ostr << "Policy after " << StatSimulations.GetTotal() << " simulations" << endl;
 		DisplayPolicy(6, ostr);
-		ostr << "Values after " << Params.NumSimulations << " simulations" << endl;
+		ostr << "Values after " << StatSimulations.GetTotal() << " simulations" << endl;
 		DisplayValue(6, ostr);
 	}
 }
@@ -469,25 +1242,52 @@ void MCTS::DisplayValue(int depth, ostream& ostr) const
 {
 	HISTORY history;
 	ostr << "MCTS Values:" << endl;
-	Root->DisplayValue(history, depth, ostr);
+	Root->DisplayValue(*Arena, history, depth, ostr);
 }
 
 void MCTS::DisplayPolicy(int depth, ostream& ostr) const
 {
 	HISTORY history;
 	ostr << "MCTS Policy:" << endl;
-	Root->DisplayPolicy(history, depth, ostr);
+	Root->DisplayPolicy(*Arena, history, depth, ostr);
 }
 
 //-----------------------------------------------------------------------------
 
 void MCTS::UnitTest()
 {
+	PAGES::UnitTest();
+	CHILD_MAP::UnitTest();
+	NODE_ARENA::UnitTest();
+	RECLAIMER::UnitTest();
+	VNODE_T<FULL_STATISTICS>::UnitTest();
+	VNODE_T<COMPACT_STATISTICS>::UnitTest();
+	SELECTION::UnitTest();
+	THREAD_POOL::UnitTest();
+	RANDOM::UnitTest();
 	UnitTestGreedy();
 	UnitTestUCB();
 	UnitTestRollout();
 	for (int depth = 1; depth <= 3; ++depth)
 		UnitTestSearch(depth);
+	UnitTestRootParallel();
+	UnitTestTreeParallel();
+	UnitTestLeafParallel();
+	UnitTestExpand();
+	UnitTestReentrant();
+	UnitTestPonder();
+	UnitTestReuse();
+	UnitTestTreeMemory();
+	UnitTestTimeBudget();
+	BUDGET::UnitTest();
+	if (VNODE::HasVariance)
+	{
+		// Both read the variance, which compact trees do not keep
+		UnitTestEarlyStop();
+		UnitTestBudget();
+	}
+	UnitTestAnytime();
+	PLANNER::UnitTest();
 }
 
 void MCTS::UnitTestGreedy()
@@ -500,9 +1300,9 @@ void MCTS::UnitTestGreedy()
 
 	VNODE* vnode = mcts.ExpandNode(testSimulator.CreateStartState());
 	vnode->Value.Set(1, 0);
-	vnode->Child(0).Value.Set(0, 1);
+	vnode->ActionValue(0).Set(1, 1);
 	for (int action = 1; action < numAct; action++)
-		vnode->Child(action).Value.Set(0, 0);
+		vnode->ActionValue(action).Set(1, 0);
 	assert(mcts.GreedyUCB(vnode, false) == 0);
 }
 
@@ -519,9 +1319,9 @@ void MCTS::UnitTestUCB()
 	vnode1->Value.Set(1, 0);
 	for (int action = 0; action < numAct; action++)
 		if (action == 3)
-			vnode1->Child(action).Value.Set(99, 0);
+			vnode1->ActionValue(action).Set(99, 0);
 		else
-			vnode1->Child(action).Value.Set(100 + action, 0);
+			vnode1->ActionValue(action).Set(100 + action, 0);
 	assert(mcts.GreedyUCB(vnode1, true) == 3);
 
 	// With high counts, action with highest value is selected
@@ -529,9 +1329,9 @@ void MCTS::UnitTestUCB()
 	vnode2->Value.Set(1, 0);
 	for (int action = 0; action < numAct; action++)
 		if (action == 3)
-			vnode2->Child(action).Value.Set(99 + numObs, 1);
+			vnode2->ActionValue(action).Set(99 + numObs, 1);
 		else
-			vnode2->Child(action).Value.Set(100 + numAct - action, 0);
+			vnode2->ActionValue(action).Set(100 + numAct - action, 0);
 	assert(mcts.GreedyUCB(vnode2, true) == 3);
 
 	// Action with low value and low count beats actions with high counts
@@ -539,9 +1339,9 @@ void MCTS::UnitTestUCB()
 	vnode3->Value.Set(1, 0);
 	for (int action = 0; action < numAct; action++)
 		if (action == 3)
-			vnode3->Child(action).Value.Set(1, 1);
+			vnode3->ActionValue(action).Set(1, 1);
 		else
-			vnode3->Child(action).Value.Set(100 + action, 1);
+			vnode3->ActionValue(action).Set(100 + action, 1);
 	assert(mcts.GreedyUCB(vnode3, true) == 3);
 
 	// Actions with zero count is always selected
@@ -549,9 +1349,9 @@ void MCTS::UnitTestUCB()
 	vnode4->Value.Set(1, 0);
 	for (int action = 0; action < numAct; action++)
 		if (action == 3)
-			vnode4->Child(action).Value.Set(0, 0);
+			vnode4->ActionValue(action).Set(0, 0);
 		else
-			vnode4->Child(action).Value.Set(1, 1);
+			vnode4->ActionValue(action).Set(1, 1);
 	assert(mcts.GreedyUCB(vnode4, true) == 3);
 }
 
@@ -587,4 +1387,344 @@ void MCTS::UnitTestSearch(int depth)
 	assert(fabs(optimalValue - rootValue) < 0.1);
 }
 
+void MCTS::UnitTestRootParallel()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 1000;
+	params.Parallel = PARAMS::PARALLEL_ROOT;
+	params.NumThreads = 4;
+	RANDOM::Thread().Seed(1);
+	MCTS mcts(testSimulator, params);
+	mcts.UCTSearch();
+	assert(mcts.Root->Value.GetCount() == params.NumSimulations);
+	assert(mcts.GreedyUCB(mcts.Root, false) == 0);
+	double rootValue = mcts.Root->Value.GetValue();
+	double optimalValue = testSimulator.OptimalValue();
+	assert(fabs(optimalValue - rootValue) < 0.2);
+
+	// Repeated with the same seed, the search is the same
+	RANDOM::Thread().Seed(1);
+	MCTS repeat(testSimulator, params);
+	repeat.UCTSearch();
+	for (int action = 0; action < testSimulator.GetNumActions(); action++)
+	{
+		assert(repeat.Root->ActionValue(action).GetCount() == mcts.Root->ActionValue(action).GetCount());
+		assert(repeat.Root->ActionValue(action).GetValue() == mcts.Root->ActionValue(action).GetValue());
+	}
+}
+
+void MCTS::UnitTestTreeParallel()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 1000;
+	params.Parallel = PARAMS::PARALLEL_TREE;
+	params.NumThreads = 4;
+	MCTS mcts(testSimulator, params);
+	mcts.UCTSearch();
+
+	// Virtual losses are all removed again
+	int count = 0;
+	for (int action = 0; action < testSimulator.GetNumActions(); action++)
+		count += mcts.Root->ActionValue(action).GetCount();
+	assert(count == params.NumSimulations);
+	assert(mcts.Root->Value.GetCount() == params.NumSimulations);
+	assert(mcts.GreedyUCB(mcts.Root, false) == 0);
+	double rootValue = mcts.Root->Value.GetValue();
+	double optimalValue = testSimulator.OptimalValue();
+	assert(fabs(optimalValue - rootValue) < 0.1);
+
+	// As in a serial search, the first visit to an action rolls out
+	// rather than expanding, even though its virtual loss is counted
+	params.NumSimulations = 1;
+	MCTS single(testSimulator, params);
+	single.UCTSearch();
+	assert(single.Arena->GetNumAllocated() == 1);
+}
+
+void MCTS::UnitTestExpand()
+{
+	TEST_SIMULATOR testSimulator(2, 2, 0);
+	PARAMS params;
+	params.Parallel = PARAMS::PARALLEL_TREE;
+	params.NumThreads = 2;
+	MCTS mcts(testSimulator, params);
+	MCTS worker(mcts, true);
+	STATE* state = testSimulator.CreateStartState();
+
+	// Losing an expansion race returns the winner and recycles the loser
+	QNODE& qnode = mcts.Root->Child(0, *mcts.Arena);
+	VNODE* winner = worker.Expand(qnode, 0, *state);
+	assert(qnode.Child(0) == winner->GetHandle());
+	assert(worker.Expand(qnode, 0, *state) == winner);
+	int numAllocated = mcts.Arena->GetNumAllocated();
+	VNODE* recycled = mcts.Arena->Create(testSimulator.GetNumActions());
+	assert(recycled->GetHandle() == winner->GetHandle() + 1);
+	assert(mcts.Arena->GetNumAllocated() == numAllocated + 1);
+	mcts.Arena->Free(recycled, testSimulator);
+	testSimulator.FreeState(state);
+}
+
+void MCTS::UnitTestReentrant()
+{
+	// Planners for different problems searching at the same time
+	TEST_SIMULATOR simulator1(3, 2, 2), simulator2(4, 3, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 10000;
+	double values[2];
+	std::thread thread([&]()
+	{
+		MCTS mcts(simulator2, params);
+		mcts.UCTSearch();
+		values[1] = mcts.Root->Value.GetValue();
+	});
+	{
+		MCTS mcts(simulator1, params);
+		mcts.UCTSearch();
+		values[0] = mcts.Root->Value.GetValue();
+	}
+	thread.join();
+	assert(fabs(simulator1.OptimalValue() - values[0]) < 0.1);
+	assert(fabs(simulator2.OptimalValue() - values[1]) < 0.1);
+}
+
+void MCTS::UnitTestPonder()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 1000;
+	params.Ponder = true;
+	MCTS mcts(testSimulator, params);
+
+	// Pondering adds a full budget under the selected action
+	int action = mcts.SelectAction();
+	mcts.PonderThread.join();
+	assert(mcts.Root->Value.GetCount() == 2 * params.NumSimulations);
+
+	// The matched subtree is kept as the new root
+	VNODE* vnode = mcts.Arena->Get(mcts.Root->Child(action).Child(0));
+	assert(vnode);
+	int count = vnode->Value.GetCount();
+	assert(mcts.Update(action, 0, 0));
+	assert(mcts.Root == vnode);
+	assert(mcts.Root->Value.GetCount() == count);
+	assert(!mcts.Root->Beliefs().Empty());
+}
+
+void MCTS::UnitTestReuse()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 200;
+	params.DeferTeardown = true;
+	for (int reuse = 0; reuse < 2; reuse++)
+	{
+		params.ReuseTree = reuse;
+		MCTS mcts(testSimulator, params);
+		int action = mcts.SelectAction();
+		VNODE* vnode = mcts.Arena->Get(mcts.Root->Child(action).Child(0));
+		assert(vnode);
+		int count = vnode->Value.GetCount();
+
+		int numNodes = 0;
+		vector<const VNODE*> open(1, vnode);
+		while (!open.empty())
+		{
+			const VNODE* node = open.back();
+			open.pop_back();
+			numNodes++;
+			for (int a = 0; a < node->GetNumChildren(); a++)
+			{
+				const CHILD_MAP& children = node->Child(a).GetChildren();
+				for (int slot = 0; slot < children.GetNumSlots(); slot++)
+					if (children.GetChild(slot))
+						open.push_back(mcts.Arena->Get(children.GetChild(slot)));
+			}
+		}
+
+		// The matched subtree keeps its statistics, and only its
+		// siblings are freed, otherwise search starts from a new root
+		assert(mcts.Update(action, 0, 0));
+		assert(!mcts.Root->Beliefs().Empty());
+		mcts.Reclaimer->Wait();
+		if (reuse)
+		{
+			assert(mcts.Root == vnode);
+			assert(mcts.Root->Value.GetCount() == count);
+			assert(mcts.Arena->GetNumAllocated() == numNodes);
+		}
+		else
+		{
+			assert(mcts.Root->Value.GetCount() == 0);
+			assert(mcts.Arena->GetNumAllocated() == 1);
+		}
+		mcts.SelectAction();
+		assert(mcts.Root->Value.GetCount() == (reuse ? count : 0) + params.NumSimulations);
+	}
+}
+
+void MCTS::UnitTestTreeMemory()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 4);
+	PARAMS params;
+	params.MaxDepth = 4;
+	params.NumSimulations = 2000;
+	MCTS unbounded(testSimulator, params);
+	unbounded.SelectAction();
+	size_t bytes = unbounded.GetTreeBytes();
+
+	// The tree is kept near the limit by evicting the least visited nodes
+	params.TreeMemory = bytes / 4 / 1048576.0;
+	MCTS mcts(testSimulator, params);
+	int action = mcts.SelectAction();
+	assert(mcts.StatEvictions.GetTotal() > 0);
+	assert(mcts.GetTreeBytes() <= params.TreeMemory * 1048576.0);
+	assert(mcts.Root->Value.GetCount() == params.NumSimulations);
+	assert(action == unbounded.GreedyUCB(unbounded.Root, false));
+
+	// Nodes holding particles are never evicted
+	struct { int operator()(const VNODE& root) const
+	{
+		int numChildren = 0;
+		for (int a = 0; a < root.GetNumChildren(); a++)
+		{
+			const CHILD_MAP& children = root.Child(a).GetChildren();
+			for (int slot = 0; slot < children.GetNumSlots(); slot++)
+				if (children.GetChild(slot))
+					numChildren++;
+		}
+		return numChildren;
+	} } depthOne;
+	int numDepthOne = depthOne(*mcts.Root);
+	mcts.Params.TreeMemory /= 2;
+	int numEvicted = mcts.NumEvicted;
+	mcts.Prune();
+	assert(mcts.NumEvicted > numEvicted);
+	assert(depthOne(*mcts.Root) == numDepthOne);
+}
+
+void MCTS::UnitTestTimeBudget()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 10;
+	params.TimeBudget = 20;
+	for (int parallel = PARAMS::PARALLEL_NONE; parallel <= PARAMS::PARALLEL_TREE; parallel++)
+	{
+		params.Parallel = parallel;
+		params.NumThreads = parallel == PARAMS::PARALLEL_NONE ? 1 : 2;
+		MCTS mcts(testSimulator, params);
+		mcts.UCTSearch();
+
+		// Stops at the deadline, whatever NumSimulations says
+		assert(mcts.StatSearchTime.GetTotal() < 0.2);
+		assert(mcts.StatSimulations.GetTotal() > params.NumSimulations);
+		assert(mcts.Root->Value.GetCount() == mcts.StatSimulations.GetTotal());
+	}
+}
+
+void MCTS::UnitTestEarlyStop()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 1);
+	PARAMS params;
+	params.MaxDepth = 2;
+	params.NumSimulations = 10000;
+	params.EarlyStop = 3;
+	for (int parallel = PARAMS::PARALLEL_NONE; parallel <= PARAMS::PARALLEL_TREE; parallel += 2)
+	{
+		params.Parallel = parallel;
+		params.NumThreads = parallel == PARAMS::PARALLEL_NONE ? 1 : 2;
+		MCTS mcts(testSimulator, params);
+		mcts.UCTSearch();
+
+		// Stops early, without changing the choice of action
+		int numSimulations = mcts.StatSimulations.GetTotal();
+		assert(numSimulations < params.NumSimulations);
+		assert(mcts.StatUnusedSimulations.GetTotal() == params.NumSimulations - numSimulations);
+		assert(mcts.GreedyUCB(mcts.Root, false) == 0);
+	}
+}
+
+void MCTS::UnitTestBudget()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.EpisodeBudget = 10000;
+	params.BudgetSteps = 10;
+	MCTS mcts(testSimulator, params);
+
+	// First step spends between its share and three times its share,
+	// in a single search
+	assert(mcts.SelectAction() == 0);
+	double used = params.EpisodeBudget - mcts.Budget->GetRemaining();
+	assert(used >= 750 && used <= 2250);
+	assert(mcts.Budget->GetStep() == 1);
+	assert(mcts.StatSimulations.GetCount() == 1);
+	assert(mcts.StatSimulations.GetTotal() == used);
+	assert(mcts.Root->Value.GetCount() == used);
+}
+
+void MCTS::UnitTestAnytime()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 1000;
+	for (int parallel = PARAMS::PARALLEL_NONE; parallel <= PARAMS::PARALLEL_TREE; parallel++)
+	{
+		params.Parallel = parallel;
+		params.NumThreads = parallel == PARAMS::PARALLEL_NONE ? 1 : 2;
+		MCTS mcts(testSimulator, params);
+
+		// Slices add up in one tree, without restarting the search
+		mcts.BeginSearch();
+		assert(mcts.Advance(400) == 400);
+		assert(mcts.Advance(600) == 600);
+		assert(mcts.AdvanceFor(5000) > 0);
+		int numSimulations = mcts.StatTotalReward.GetCount();
+		assert(mcts.Root->Value.GetCount() == numSimulations);
+		assert(mcts.CurrentBestAction() == 0);
+		assert(fabs(mcts.CurrentValue() - testSimulator.OptimalValue()) < 0.1);
+
+		assert(mcts.CommitSearch() == 0);
+		assert(mcts.StatSimulations.GetTotal() == numSimulations);
+	}
+}
+
+void MCTS::UnitTestLeafParallel()
+{
+	TEST_SIMULATOR testSimulator(2, 2, 10);
+	PARAMS params;
+	params.MaxDepth = 10;
+	params.Parallel = PARAMS::PARALLEL_LEAF;
+	params.NumThreads = 4;
+	params.LeafRollouts = 8;
+	MCTS mcts(testSimulator, params);
+
+	// Averaged rollouts from the leaf estimate the random policy value
+	double totalReward = 0;
+	for (int n = 0; n < 100; ++n)
+	{
+		STATE* state = testSimulator.CreateStartState();
+		mcts.TreeDepth = 0;
+		totalReward += mcts.LeafRollout(*state);
+		testSimulator.FreeState(state);
+	}
+	double rootValue = totalReward / 100;
+	double meanValue = testSimulator.MeanValue();
+	assert(fabs(meanValue - rootValue) < 0.2);
+	assert(mcts.LeafWorkers[0]->StatRolloutDepth.GetCount()
+		+ mcts.LeafWorkers[1]->StatRolloutDepth.GetCount()
+		+ mcts.LeafWorkers[2]->StatRolloutDepth.GetCount()
+		+ mcts.LeafWorkers[3]->StatRolloutDepth.GetCount() == 800);
+}
+
 //-----------------------------------------------------------------------------
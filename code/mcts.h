@@ -2,8 +2,14 @@
 #define MCTS_H
 
 #include "simulator.h"
+#include "budget.h"
 #include "node.h"
+#include "reclaimer.h"
 #include "statistic.h"
+#include "threadpool.h"
+#include <chrono>
+#include <mutex>
+#include <thread>
 
 class MCTS
 {
@@ -25,6 +31,13 @@ public:
 			ROLLOUT = 4 // output results of each rollout step
 		};
 
+		enum {
+			PARALLEL_NONE = 0, // single threaded search
+			PARALLEL_ROOT = 1, // independent trees per thread, merged at the root
+			PARALLEL_TREE = 2, // one tree shared by all threads, using virtual loss
+			PARALLEL_LEAF = 3 // batches of rollouts from each leaf run on all threads
+		};
+
 		int Verbose; // level of verbosity
 		int MaxDepth; // maximum tree depth (search horizon)
 		int NumSimulations; // number of simulations to perform
@@ -39,6 +52,20 @@ public:
 		double RaveDiscount;
 		double RaveConstant;
 		bool DisableTree; // whether or not to use a basic monte carlo strategy (PO-rollout in the POMCP paper)
+		int Parallel; // parallelisation scheme used by UCTSearch
+		int NumThreads; // number of search threads
+		int BatchSize; // simulations per task handed to the scheduler
+		double VirtualLoss; // return assumed for pending visits in a shared tree
+		int LeafRollouts; // number of rollouts averaged at each leaf in leaf parallel search
+		bool Ponder; // keep searching under the selected action until Update, which always keeps the matched subtree
+		bool ReuseTree; // keep the matched subtree and its statistics as the new root after Update
+		double TimeBudget; // milliseconds per search, replacing NumSimulations when positive
+		int TimeCheckInterval; // simulations between checks of the clock and of early stopping
+		double EarlyStop; // z-score multiplier of the bounds for stopping early, 0 to disable
+		double EpisodeBudget; // simulations, or milliseconds with a time budget, shared out over an episode, 0 to disable
+		int BudgetSteps; // number of steps the episode budget is planned over
+		double TreeMemory; // megabytes of tree nodes kept before the least visited are evicted, 0 for no limit
+		bool DeferTeardown; // free detached subtrees and particles on a background thread
 	};
 
 	MCTS(const SIMULATOR& simulator, const PARAMS& params);
@@ -47,14 +74,41 @@ public:
 	virtual int SelectAction();
 	bool Update(int action, int observation, double reward);
 
+	// Anytime search, which can be advanced in slices and committed
+	// at any point
+	void BeginSearch();
+	int Advance(int numSimulations);
+	int AdvanceFor(double microseconds);
+	int CurrentBestAction();
+	double CurrentValue() const;
+	int CommitSearch();
+
 	void UCTSearch();
+	void EndSearch();
+	void UCTSimulations(int numSimulations);
+	void RootParallelSearch(int numSimulations);
+	void TreeParallelSearch(int numSimulations);
+	void ScheduleSimulations(const std::vector<MCTS*>& workers, int numSimulations);
 	void RolloutSearch();
+	void BudgetedSearch();
+	double SearchFor(double amount);
+	double RootUncertainty() const;
+	void StartClock();
+	bool TimeUp() const;
+	bool Settled(int remaining) const;
+	void StartPondering(int action);
+	void StopPondering();
+	void Ponder(int action);
 
 	double Rollout(STATE& state);
+	double LeafRollout(STATE& state);
 
 	const BELIEF_STATE& BeliefState() const { return Root->Beliefs(); }
-	const HISTORY& GetHistory() const { return History; }
-	const SIMULATOR::STATUS& GetStatus() const { return Status; }
+	const HISTORY& GetHistory() const { return Context.History; }
+	const SIMULATOR::STATUS& GetStatus() const { return Context.Status; }
+	const SIMULATOR::CONTEXT& GetContext() const { return Context; }
+	const THREAD_POOL* GetScheduler() const { return Pool; }
+	size_t GetTreeBytes() const; // approximate size of the nodes in the tree
 	void ClearStatistics();
 	void DisplayStatistics(std::ostream& ostr) const;
 	void DisplayValue(int depth, std::ostream& ostr) const;
@@ -63,37 +117,88 @@ public:
 	static void UnitTest();
 	static void InitFastUCB(double exploration);
 
-	int GreedyUCB(VNODE* vnode, bool ucb) const;
+	int GreedyUCB(VNODE* vnode, bool ucb);
 	int SelectRandom() const;
 	double SimulateV(STATE& state, VNODE* vnode);
-	double SimulateQ(STATE& state, QNODE& qnode, int action);
+	double SimulateQ(STATE& state, VNODE* parent, int action);
 	void AddRave(VNODE* vnode, double totalReward);
 	VNODE* ExpandNode(const STATE* state);
+	VNODE* Expand(QNODE& qnode, int observation, const STATE& state);
 	void AddSample(VNODE* node, const STATE& state);
 	void AddTransforms(VNODE* root, BELIEF_STATE& beliefs);
 	STATE* CreateTransform() const;
 	void Resample(BELIEF_STATE& beliefs);
 
+	// Root statistics from before a root parallel search, without the tree
+	struct ROOT_STATISTICS
+	{
+		VALUE<int> Value;
+		VNODE::ACTION_VALUES ActionValues;
+		VNODE::ACTION_AMAFS ActionAMAFs;
+	};
+	void MergeRoot(const MCTS& worker, const ROOT_STATISTICS& base);
+
+	void FreeTree();
+	void FreeBeliefs(BELIEF_STATE& beliefs);
+	void Prune();
+
 	// Fast lookup table for UCB
 	static const int UCB_N = 10000, UCB_n = 100;
 	static double UCB[UCB_N][UCB_n];
 	static bool InitialisedFastUCB;
 
-	double FastUCB(int N, int n, double logN) const;
 	const SIMULATOR& Simulator;
 	int TreeDepth, PeakTreeDepth;
 	PARAMS Params;
 	VNODE* Root;
-	HISTORY History;
-	SIMULATOR::STATUS Status;
+	NODE_ARENA* Arena; // shared by the master and all its workers
+	SIMULATOR::CONTEXT Context;
 	STATISTIC StatTreeDepth;
 	STATISTIC StatRolloutDepth;
 	STATISTIC StatTotalReward;
+	STATISTIC StatSearchTime;
+	STATISTIC StatPonderSimulations;
+	STATISTIC StatSimulations;
+	STATISTIC StatUnusedSimulations;
+	STATISTIC StatEvictions;
 private:
+
+	// Worker searching from the root beliefs of master, in its own tree
+	// or in the tree of master when shareTree is set
+	MCTS(const MCTS& master, bool shareTree = false);
+
+	const MCTS* Master;
+	bool SharedTree;
+	THREAD_POOL* Pool;
+	std::vector<MCTS*> LeafWorkers;
+	BUDGET* Budget;
+	RECLAIMER* Reclaimer; // master only
+	std::thread PonderThread;
+	bool PonderStop;
+	std::chrono::steady_clock::time_point Deadline;
+	bool HasDeadline;
+	double SearchTime;
+	size_t NodeBytes; // size of a newly expanded node
+	int NumEvicted; // nodes evicted during the current search
+
+	int Commit();
+
 	static void UnitTestGreedy();
 	static void UnitTestUCB();
 	static void UnitTestRollout();
 	static void UnitTestSearch(int depth);
+	static void UnitTestRootParallel();
+	static void UnitTestTreeParallel();
+	static void UnitTestLeafParallel();
+	static void UnitTestExpand();
+	static void UnitTestReentrant();
+	static void UnitTestPonder();
+	static void UnitTestReuse();
+	static void UnitTestTreeMemory();
+	static void UnitTestTimeBudget();
+	static void UnitTestEarlyStop();
+	static void UnitTestBudget();
+	static void UnitTestAnytime();
 };
 
 #endif // MCTS_H
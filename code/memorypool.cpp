@@ -0,0 +1,120 @@
+#include "memorypool.h"
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+
+namespace PAGES
+{
+
+BLOCK Allocate(size_t bytes, bool hugePages)
+{
+	BLOCK block;
+#ifdef __linux__
+	if (hugePages && bytes >= HugePageSize)
+	{
+		size_t size = (bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+
+		// Reserved huge pages, when the system has any
+		void* memory = mmap(0, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory != MAP_FAILED)
+		{
+			block.Memory = static_cast<char*>(memory);
+			block.Bytes = size;
+			block.Mapped = true;
+			return block;
+		}
+
+		// Otherwise transparent huge pages, which need aligned memory
+		memory = mmap(0, size + HugePageSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory != MAP_FAILED)
+		{
+			char* start = static_cast<char*>(memory);
+			char* aligned = reinterpret_cast<char*>(
+				(reinterpret_cast<uintptr_t>(start) + HugePageSize - 1) & ~(HugePageSize - 1));
+			if (aligned > start)
+				munmap(start, aligned - start);
+			if (aligned + size < start + size + HugePageSize)
+				munmap(aligned + size, start + size + HugePageSize - (aligned + size));
+			madvise(aligned, size, MADV_HUGEPAGE);
+			block.Memory = aligned;
+			block.Bytes = size;
+			block.Mapped = true;
+			return block;
+		}
+	}
+#endif
+
+	block.Memory = static_cast<char*>(::operator new(bytes));
+	block.Bytes = bytes;
+	return block;
+}
+
+void Free(BLOCK& block)
+{
+#ifdef __linux__
+	if (block.Mapped)
+		munmap(block.Memory, block.Bytes);
+	else
+#endif
+		::operator delete(block.Memory);
+	block = BLOCK();
+}
+
+void UnitTest()
+{
+	// Small blocks and large blocks, with or without huge pages
+	for (int huge = 0; huge < 2; huge++)
+	{
+		BLOCK small = Allocate(1000, huge);
+		assert(small.Bytes == 1000);
+		BLOCK large = Allocate(HugePageSize + 1, huge);
+		assert(large.Bytes >= HugePageSize + 1);
+		small.Memory[999] = 1;
+		large.Memory[0] = large.Memory[large.Bytes - 1] = 1;
+		Free(small);
+		Free(large);
+		assert(!large.Memory);
+	}
+
+	// Objects are reused most recently freed first, and trimming returns
+	// only chunks that are entirely free
+	struct OBJECT : public MEMORY_OBJECT { int Value; };
+	MEMORY_POOL<OBJECT> pool(4);
+	vector<OBJECT*> objects;
+	for (int i = 0; i < 10; i++)
+		objects.push_back(pool.Allocate());
+	assert(pool.GetNumChunks() == 3);
+	assert(pool.GetNumAllocated() == 10 && pool.GetNumFree() == 2);
+	pool.Free(objects[3]);
+	assert(pool.Allocate() == objects[3]);
+
+	for (int i = 0; i < 8; i++)
+		pool.Free(objects[i]);
+	pool.Trim();
+	assert(pool.GetNumChunks() == 1);
+	assert(pool.GetNumAllocated() == 2 && pool.GetNumFree() == 2);
+	OBJECT* obj = pool.Allocate();
+	assert(obj != objects[8] && obj != objects[9]);
+	pool.Free(obj);
+	pool.Free(objects[8]);
+	pool.Free(objects[9]);
+	pool.Trim();
+	assert(pool.GetNumChunks() == 0 && pool.GetNumFree() == 0);
+
+	// Huge page chunks fill whole pages
+	MEMORY_POOL<OBJECT> hugePool(1, true);
+	hugePool.Free(hugePool.Allocate());
+	assert(hugePool.GetNumFree() * sizeof(OBJECT) >= HugePageSize - sizeof(OBJECT));
+}
+
+}
+
+//-----------------------------------------------------------------------------
@@ -1,8 +1,40 @@
 #ifndef MEMORY_POOL_H
 #define MEMORY_POOL_H
 
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <new>
 #include <vector>
 #include <ostream>
+#include <mutex>
+
+//-----------------------------------------------------------------------------
+// Page-level memory for large blocks of objects. Blocks of at least one
+// huge page are backed by 2 MB pages where the system allows, which cuts
+// TLB misses when millions of small objects are live, and by normal pages
+// otherwise.
+
+namespace PAGES
+{
+	const size_t HugePageSize = 2 << 20;
+
+	struct BLOCK
+	{
+		BLOCK() : Memory(0), Bytes(0), Mapped(false) { }
+
+		char* Memory;
+		size_t Bytes; // may be rounded up from the size requested
+		bool Mapped;
+	};
+
+	BLOCK Allocate(size_t bytes, bool hugePages);
+	void Free(BLOCK& block);
+
+	void UnitTest();
+}
+
+//-----------------------------------------------------------------------------
 
 class MEMORY_OBJECT
 {
@@ -15,15 +47,40 @@ public:
 private:
 
 	bool Allocated;
+	MEMORY_OBJECT* NextFree; // link in the free list of the pool
+
+	template <class T> friend class MEMORY_POOL;
 };
 
+//-----------------------------------------------------------------------------
+// Objects allocated in chunks and linked through their own storage while
+// they are free. Objects are constructed once, when their chunk is made,
+// and keep their contents (such as the capacity of vectors) while free.
+// Chunks hold chunkSize objects, or fill whole huge pages when hugePages
+// is set. Trim returns the chunks whose objects are all free.
+
 template <class T>
 class MEMORY_POOL
 {
 public:
 
-	MEMORY_POOL()
-		: NumAllocated(0)
+	MEMORY_POOL(int chunkSize = 256, bool hugePages = false)
+		: ChunkSize(chunkSize),
+		HugePages(hugePages),
+		FreeList(0),
+		NumAllocated(0),
+		NumFree(0)
+	{
+		assert(ChunkSize > 0);
+	}
+
+	// Copies start empty, objects always return to the pool that made them
+	MEMORY_POOL(const MEMORY_POOL& pool)
+		: ChunkSize(pool.ChunkSize),
+		HugePages(pool.HugePages),
+		FreeList(0),
+		NumAllocated(0),
+		NumFree(0)
 	{
 	}
 
@@ -46,58 +103,147 @@ public:
 
 	T* Allocate()
 	{
-		if (FreeList.empty())
+		std::lock_guard<std::mutex> lock(Mutex);
+		if (!FreeList)
 			NewChunk();
-		T* obj = FreeList.back();
-		FreeList.pop_back();
+		T* obj = static_cast<T*>(FreeList);
+		FreeList = obj->NextFree;
 		assert(!obj->IsAllocated());
 		obj->SetAllocated();
 		NumAllocated++;
+		NumFree--;
 		return obj;
 	}
 
 	void Free(T* obj)
 	{
+		std::lock_guard<std::mutex> lock(Mutex);
 		assert(obj->IsAllocated());
 		obj->ClearAllocated();
-		FreeList.push_back(obj);
+		obj->NextFree = FreeList;
+		FreeList = obj;
 		NumAllocated--;
+		NumFree++;
+	}
+
+	// Return chunks with no allocated objects, for use between episodes
+	void Trim()
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+
+		// Count the free objects of each chunk, chunks are kept in
+		// address order
+		std::vector<int> numFree(Chunks.size(), 0);
+		for (MEMORY_OBJECT* obj = FreeList; obj; obj = obj->NextFree)
+			numFree[FindChunk(static_cast<T*>(obj))]++;
+
+		std::vector<bool> release(Chunks.size());
+		bool any = false;
+		for (int i = 0; i < Chunks.size(); i++)
+		{
+			release[i] = numFree[i] == Chunks[i].NumObjects;
+			any = any || release[i];
+		}
+		if (!any)
+			return;
+
+		// Unlink the objects of released chunks, keeping the others in order
+		MEMORY_OBJECT** link = &FreeList;
+		while (*link)
+		{
+			if (release[FindChunk(static_cast<T*>(*link))])
+			{
+				*link = (*link)->NextFree;
+				NumFree--;
+			}
+			else
+				link = &(*link)->NextFree;
+		}
+
+		int kept = 0;
+		for (int i = 0; i < Chunks.size(); i++)
+		{
+			if (release[i])
+				DeleteChunk(Chunks[i]);
+			else
+				Chunks[kept++] = Chunks[i];
+		}
+		Chunks.resize(kept);
 	}
 
 	void DeleteAll()
 	{
-		for (ChunkIterator i_chunk = Chunks.begin(); i_chunk != Chunks.end(); ++i_chunk)
-			delete *i_chunk;
+		std::lock_guard<std::mutex> lock(Mutex);
+		for (int i = 0; i < Chunks.size(); i++)
+			DeleteChunk(Chunks[i]);
 		Chunks.clear();
-		FreeList.clear();
+		FreeList = 0;
 		NumAllocated = 0;
+		NumFree = 0;
 	}
 
 	int GetNumAllocated() const { return NumAllocated; }
+	int GetNumFree() const { return NumFree; }
+	int GetNumChunks() const { return Chunks.size(); }
 
 private:
 
 	struct CHUNK
 	{
-		static const int Size = 256;
-		T Objects[Size];
+		PAGES::BLOCK Block;
+		T* Objects;
+		int NumObjects;
 	};
 
 	void NewChunk()
 	{
-		CHUNK* chunk = new CHUNK;
-		Chunks.push_back(chunk);
-		for (int i = CHUNK::Size - 1; i >= 0; --i)
+		CHUNK chunk;
+		size_t bytes = ChunkSize * sizeof(T);
+		if (HugePages)
+			bytes = std::max(bytes, PAGES::HugePageSize);
+		chunk.Block = PAGES::Allocate(bytes, HugePages);
+		chunk.Objects = reinterpret_cast<T*>(chunk.Block.Memory);
+		chunk.NumObjects = chunk.Block.Bytes / sizeof(T);
+
+		// Linked so that the first object is handed out first
+		for (int i = chunk.NumObjects - 1; i >= 0; --i)
 		{
-			FreeList.push_back(&chunk->Objects[i]);
-			chunk->Objects[i].ClearAllocated();
+			T* obj = new (&chunk.Objects[i]) T;
+			obj->ClearAllocated();
+			obj->NextFree = FreeList;
+			FreeList = obj;
 		}
+		NumFree += chunk.NumObjects;
+		Chunks.insert(std::upper_bound(Chunks.begin(), Chunks.end(), chunk, Before), chunk);
+	}
+
+	void DeleteChunk(CHUNK& chunk)
+	{
+		for (int i = 0; i < chunk.NumObjects; i++)
+			chunk.Objects[i].~T();
+		PAGES::Free(chunk.Block);
+	}
+
+	int FindChunk(const T* obj) const
+	{
+		CHUNK key;
+		key.Objects = const_cast<T*>(obj);
+		int i = std::upper_bound(Chunks.begin(), Chunks.end(), key, Before) - Chunks.begin() - 1;
+		assert(i >= 0 && obj < Chunks[i].Objects + Chunks[i].NumObjects);
+		return i;
+	}
+
+	static bool Before(const CHUNK& a, const CHUNK& b)
+	{
+		return std::less<T*>()(a.Objects, b.Objects);
 	}
 
-	std::vector<CHUNK*> Chunks;
-	std::vector<T*> FreeList;
-	int NumAllocated;
-	typedef typename std::vector<CHUNK*>::iterator ChunkIterator;
+	int ChunkSize;
+	bool HugePages;
+	std::vector<CHUNK> Chunks; // in address order
+	MEMORY_OBJECT* FreeList;
+	int NumAllocated, NumFree;
+	std::mutex Mutex; // pools are shared by parallel searches
 };
 
 #endif // MEMORY_POOL_H
@@ -62,6 +62,11 @@ STATE* NETWORK::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* NETWORK::Clone() const
+{
+	return new NETWORK(*this);
+}
+
 void NETWORK::Validate(const STATE& state) const
 {
 	const NETWORK_STATE& nstate = safe_cast<const NETWORK_STATE&>(state);
@@ -82,6 +87,11 @@ void NETWORK::FreeState(STATE* state) const
 	MemoryPool.Free(nstate);
 }
 
+void NETWORK::TrimMemory() const
+{
+	MemoryPool.Trim();
+}
+
 bool NETWORK::Step(STATE& state, int action,
 	int& observation, double& reward) const
 {
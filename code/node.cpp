@@ -1,137 +1,733 @@
 #include "node.h"
 #include "history.h"
+#include "testsimulator.h"
 #include "utils.h"
+#include <algorithm>
+#include <thread>
 
 using namespace std;
+using namespace UTILS;
 
 //-----------------------------------------------------------------------------
 
-int QNODE::NumChildren = 0;
+CHILD_MAP::TABLE::TABLE(int capacity)
+	: Capacity(capacity),
+	Size(0),
+	Entries(capacity, 0),
+	Retired(0)
+{
+}
+
+CHILD_MAP::TABLE::~TABLE()
+{
+	delete Retired;
+}
+
+CHILD_MAP::CHILD_MAP()
+	: Table(0)
+{
+	for (int i = 0; i < NumInline; i++)
+		InlineEntries[i] = 0;
+}
+
+CHILD_MAP::CHILD_MAP(const CHILD_MAP&)
+	: Table(0)
+{
+	for (int i = 0; i < NumInline; i++)
+		InlineEntries[i] = 0;
+}
+
+CHILD_MAP::~CHILD_MAP()
+{
+	delete Table;
+}
+
+int CHILD_MAP::Probe(const TABLE& table, int observation)
+{
+	// Linear probing from a multiplicative hash, tables are kept at most
+	// half full, but threads adding at once may briefly fill them further
+	int mask = table.Capacity - 1;
+	int slot = (unsigned(observation) * 2654435761u) & mask;
+	for (int i = 0; i < table.Capacity; i++)
+	{
+		ENTRY entry = AtomicLoad(table.Entries[slot]);
+		if (!entry || entry == Sealed || EntryObservation(entry) == observation)
+			return slot;
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+NODE_HANDLE CHILD_MAP::Find(int observation) const
+{
+	for (int i = 0; i < NumInline; i++)
+	{
+		ENTRY entry = AtomicLoad(InlineEntries[i]);
+		if (EntryObservation(entry) == observation)
+			return EntryChild(entry);
+	}
+
+	const TABLE* table = AtomicLoad(Table);
+	if (!table)
+		return 0;
+	int slot = Probe(*table, observation);
+	if (slot < 0)
+		return 0;
+	ENTRY entry = AtomicLoad(table->Entries[slot]);
+	return EntryObservation(entry) == observation ? EntryChild(entry) : 0;
+}
+
+void CHILD_MAP::Set(int observation, NODE_HANDLE child)
+{
+	assert(observation >= 0);
+
+	// Detached children keep the slot of their observation
+	for (int i = 0; i < NumInline; i++)
+	{
+		if (EntryObservation(InlineEntries[i]) == observation)
+		{
+			AtomicStore(InlineEntries[i], MakeEntry(observation, child));
+			return;
+		}
+	}
+	if (Table)
+	{
+		int slot = Probe(*Table, observation);
+		if (slot >= 0 && EntryObservation(Table->Entries[slot]) == observation)
+		{
+			AtomicStore(Table->Entries[slot], MakeEntry(observation, child));
+			return;
+		}
+	}
+	if (child)
+		Insert(observation, child, false);
+}
+
+NODE_HANDLE CHILD_MAP::Publish(int observation, NODE_HANDLE child)
+{
+	assert(observation >= 0 && child);
+	return Insert(observation, child, true);
+}
+
+NODE_HANDLE CHILD_MAP::Claim(ENTRY& slot, int observation, NODE_HANDLE child, bool& filled)
+{
+	// Fills an empty slot, or one whose child was detached, otherwise
+	// returns the child of the observation found there, or 0 for a slot
+	// taken by another observation. Only an empty slot counts as filled
+	ENTRY expected = 0;
+	filled = AtomicCompareExchange(slot, expected, MakeEntry(observation, child));
+	if (filled)
+		return child;
+	if (EntryObservation(expected) != observation)
+		return 0;
+	if (!EntryChild(expected)
+		&& AtomicCompareExchange(slot, expected, MakeEntry(observation, child)))
+		return child;
+	return EntryChild(expected);
+}
+
+NODE_HANDLE CHILD_MAP::Insert(int observation, NODE_HANDLE child, bool shared)
+{
+	// Inline slots only ever go from empty to taken, and are taken in
+	// order, so every thread adding an observation meets the same slot
+	bool filled;
+	for (int i = 0; i < NumInline; i++)
+	{
+		NODE_HANDLE found = Claim(InlineEntries[i], observation, child, filled);
+		if (found)
+			return found;
+	}
+
+	while (true)
+	{
+		TABLE* table = AtomicLoad(Table);
+		if (!table || 2 * (AtomicLoad(table->Size) + 1) > table->Capacity)
+		{
+			Grow(table, shared);
+			continue;
+		}
+
+		int slot = Probe(*table, observation);
+		if (slot >= 0 && AtomicLoad(table->Entries[slot]) != Sealed)
+		{
+			NODE_HANDLE found = Claim(table->Entries[slot], observation, child, filled);
+			if (filled)
+				AtomicAdd(table->Size, 1);
+			if (found)
+				return found;
+			continue; // the slot went to another observation
+		}
+
+		// Full, or sealed while another thread replaces the table
+		Grow(table, shared);
+	}
+}
+
+void CHILD_MAP::Grow(TABLE* full, bool shared)
+{
+	std::lock_guard<SPIN_LOCK> lock(GrowLock);
+	if (AtomicLoad(Table) != full)
+		return; // already replaced by another thread
+
+	TABLE* table = new TABLE(full ? 2 * full->Capacity : 8);
+	if (full)
+	{
+		// Empty slots are sealed so that nothing more is added to the old
+		// table, and every child added before then is copied
+		for (int slot = 0; slot < full->Capacity; slot++)
+		{
+			ENTRY entry = 0;
+			if (AtomicCompareExchange(full->Entries[slot], entry, Sealed))
+				continue;
+			table->Entries[Probe(*table, EntryObservation(entry))] = entry;
+			table->Size++;
+		}
+
+		if (shared)
+			table->Retired = full;
+		else
+		{
+			table->Retired = full->Retired;
+			full->Retired = 0;
+			delete full;
+		}
+	}
+	AtomicStore(Table, table);
+}
+
+void CHILD_MAP::Clear()
+{
+	for (int i = 0; i < NumInline; i++)
+		InlineEntries[i] = 0;
+	delete Table;
+	Table = 0;
+}
+
+int CHILD_MAP::GetObservation(int slot) const
+{
+	ENTRY entry = slot < NumInline ? InlineEntries[slot] : Table->Entries[slot - NumInline];
+	return entry == Sealed ? -1 : EntryObservation(entry);
+}
+
+NODE_HANDLE CHILD_MAP::GetChild(int slot) const
+{
+	ENTRY entry = slot < NumInline ? InlineEntries[slot] : Table->Entries[slot - NumInline];
+	return entry == Sealed ? 0 : EntryChild(entry);
+}
+
+size_t CHILD_MAP::GetHeapBytes() const
+{
+	size_t bytes = 0;
+	for (const TABLE* table = Table; table; table = table->Retired)
+		bytes += sizeof(TABLE) + table->Capacity * sizeof(ENTRY);
+	return bytes;
+}
+
+void CHILD_MAP::UnitTest()
+{
+	// Grows from inline slots through several tables
+	CHILD_MAP children;
+	struct { NODE_HANDLE operator()(int i) const { return i + 1; } } node;
+	const int numChildren = 100;
+	for (int observation = 0; observation < numChildren; observation++)
+	{
+		assert(children.Find(observation * 7) == 0);
+		if (observation % 2 == 0)
+			assert(children.Publish(observation * 7, node(observation)) == node(observation));
+		else
+			children.Set(observation * 7, node(observation));
+	}
+	for (int observation = 0; observation < numChildren; observation++)
+		assert(children.Find(observation * 7) == node(observation));
+	assert(children.Find(1) == 0);
+	assert(children.GetHeapBytes() > 0);
+
+	// Detached children leave empty slots
+	children.Set(0, 0);
+	children.Set(7 * 50, 0);
+	assert(children.Find(0) == 0);
+	assert(children.Find(7 * 50) == 0);
+	int numFound = 0;
+	for (int slot = 0; slot < children.GetNumSlots(); slot++)
+	{
+		if (children.GetChild(slot))
+		{
+			int observation = children.GetObservation(slot);
+			assert(children.GetChild(slot) == node(observation / 7));
+			numFound++;
+		}
+	}
+	assert(numFound == numChildren - 2);
+
+	// Detached slots taken again do not add to the load of the table
+	int numSlots = children.GetNumSlots();
+	for (int i = 0; i < numChildren; i++)
+	{
+		assert(children.Publish(7 * 50, node(50)) == node(50));
+		children.Set(7 * 50, 0);
+	}
+	assert(children.GetNumSlots() == numSlots);
+
+	children.Clear();
+	assert(children.Find(7) == 0);
+	assert(children.GetNumSlots() == NumInline);
+	assert(children.GetHeapBytes() == 0);
+
+	// Threads publishing the same observations agree on one child each,
+	// while the table grows underneath them
+	const int numThreads = 4;
+	vector<vector<NODE_HANDLE> > published(numThreads, vector<NODE_HANDLE>(numChildren));
+	vector<thread> threads;
+	for (int t = 0; t < numThreads; t++)
+	{
+		threads.push_back(thread([&children, &published, t]()
+		{
+			for (int observation = 0; observation < numChildren; observation++)
+				published[t][observation] = children.Publish(observation, observation * numThreads + t + 1);
+		}));
+	}
+	for (int t = 0; t < numThreads; t++)
+		threads[t].join();
+	for (int observation = 0; observation < numChildren; observation++)
+	{
+		NODE_HANDLE winner = children.Find(observation);
+		assert(winner && (winner - 1) / numThreads == NODE_HANDLE(observation));
+		for (int t = 0; t < numThreads; t++)
+			assert(published[t][observation] == winner);
+	}
+}
+
+//-----------------------------------------------------------------------------
 
 void QNODE::Initialise()
 {
-	assert(NumChildren);
-	Children.resize(NumChildren);
-	for (int observation = 0; observation < QNODE::NumChildren; observation++)
-		Children[observation] = 0;
+	ChildMap.Clear();
 	AlphaData.AlphaSum.clear();
 }
 
-void QNODE::DisplayValue(HISTORY& history, int maxDepth, ostream& ostr) const
+const QNODE& QNODE::Untried()
+{
+	static const QNODE untried = QNODE();
+	return untried;
+}
+
+void QNODE::DisplayValue(const NODE_ARENA& arena, HISTORY& history, int maxDepth, ostream& ostr) const
 {
-	history.Display(ostr);
-	ostr << ": " << Value.GetValue() << " (" << Value.GetCount() << ")\n";
 	if (history.Size() >= maxDepth)
 		return;
 
-	for (int observation = 0; observation < NumChildren; observation++)
+	for (int slot = 0; slot < ChildMap.GetNumSlots(); slot++)
 	{
-		if (Children[observation])
+		if (ChildMap.GetChild(slot))
 		{
-			history.Back().Observation = observation;
-			Children[observation]->DisplayValue(history, maxDepth, ostr);
+			history.Back().Observation = ChildMap.GetObservation(slot);
+			arena.Get(ChildMap.GetChild(slot))->DisplayValue(arena, history, maxDepth, ostr);
 		}
 	}
 }
 
-void QNODE::DisplayPolicy(HISTORY& history, int maxDepth, ostream& ostr) const
+void QNODE::DisplayPolicy(const NODE_ARENA& arena, HISTORY& history, int maxDepth, ostream& ostr) const
 {
-	history.Display(ostr);
-	ostr << ": " << Value.GetValue() << " (" << Value.GetCount() << ")\n";
 	if (history.Size() >= maxDepth)
 		return;
 
-	for (int observation = 0; observation < NumChildren; observation++)
+	for (int slot = 0; slot < ChildMap.GetNumSlots(); slot++)
 	{
-		if (Children[observation])
+		if (ChildMap.GetChild(slot))
 		{
-			history.Back().Observation = observation;
-			Children[observation]->DisplayPolicy(history, maxDepth, ostr);
+			history.Back().Observation = ChildMap.GetObservation(slot);
+			arena.Get(ChildMap.GetChild(slot))->DisplayPolicy(arena, history, maxDepth, ostr);
 		}
 	}
 }
 
 //-----------------------------------------------------------------------------
 
-MEMORY_POOL<VNODE> VNODE::VNodePool;
-
-int VNODE::NumChildren = 0;
+template<class POLICY>
+void VNODE_T<POLICY>::Initialise(int numActions)
+{
+	assert(numActions);
+	Children.assign(numActions, 0);
+	ActionValues.Resize(numActions);
+	if (HasAMAF)
+		ActionAMAFs.Resize(numActions);
+}
 
-void VNODE::Initialise()
+template<class POLICY>
+QNODE& VNODE_T<POLICY>::Child(int c, NODE_ARENA& arena)
 {
-	assert(NumChildren);
-	Children.resize(VNODE::NumChildren);
-	for (int action = 0; action < VNODE::NumChildren; action++)
-		Children[action].Initialise();
+	QNODE* qnode = FindChild(c);
+	if (qnode)
+		return *qnode;
+
+	// Another thread searching a shared tree may try the action first
+	QNODE* created = arena.CreateChild();
+	if (AtomicCompareExchange(Children[c], qnode, created))
+		return *created;
+	arena.DiscardChild(created);
+	return *qnode;
 }
 
-VNODE* VNODE::Create()
+template<class POLICY>
+void VNODE_T<POLICY>::SetChildren(int count, double value)
 {
-	VNODE* vnode = VNodePool.Allocate();
-	vnode->Initialise();
-	return vnode;
+	for (int action = 0; action < GetNumChildren(); action++)
+	{
+		ActionValues[action].Set(count, value);
+		if (HasAMAF)
+			ActionAMAFs[action].Set(count, value);
+	}
 }
 
-void VNODE::Free(VNODE* vnode, const SIMULATOR& simulator)
+template<class POLICY>
+void VNODE_T<POLICY>::CopyStatistics(const VNODE_T& vnode)
 {
-	vnode->BeliefState.Free(simulator);
-	VNodePool.Free(vnode);
-	for (int action = 0; action < VNODE::NumChildren; action++)
-		for (int observation = 0; observation < QNODE::NumChildren; observation++)
-			if (vnode->Child(action).Child(observation))
-				Free(vnode->Child(action).Child(observation), simulator);
+	Value = vnode.Value;
+	ActionValues = vnode.ActionValues;
+	ActionAMAFs = vnode.ActionAMAFs;
 }
 
-void VNODE::FreeAll()
+template<class POLICY>
+size_t VNODE_T<POLICY>::GetBytes() const
 {
-	VNodePool.DeleteAll();
+	size_t bytes = sizeof(VNODE_T) + ActionValues.GetBytes() + ActionAMAFs.GetBytes()
+		+ BeliefState.GetNumSamples() * sizeof(STATE*) + Children.size() * sizeof(QNODE*);
+	for (int action = 0; action < GetNumChildren(); action++)
+		if (Children[action])
+			bytes += sizeof(QNODE) + Children[action]->ChildMap.GetHeapBytes();
+	return bytes;
 }
 
-void VNODE::SetChildren(int count, double value)
+template<class POLICY>
+void VNODE_T<POLICY>::DisplayAction(HISTORY& history, int action, ostream& ostr) const
 {
-	for (int action = 0; action < NumChildren; action++)
-	{
-		QNODE& qnode = Children[action];
-		qnode.Value.Set(count, value);
-		qnode.AMAF.Set(count, value);
-	}
+	history.Display(ostr);
+	ostr << ": " << ActionValues[action].GetValue() << " (" << ActionValues[action].GetCount() << ")\n";
 }
 
-void VNODE::DisplayValue(HISTORY& history, int maxDepth, ostream& ostr) const
+template<class POLICY>
+void VNODE_T<POLICY>::DisplayValue(const NODE_ARENA& arena, HISTORY& history, int maxDepth, ostream& ostr) const
 {
 	if (history.Size() >= maxDepth)
 		return;
 
-	for (int action = 0; action < NumChildren; action++)
+	for (int action = 0; action < GetNumChildren(); action++)
 	{
 		history.Add(action);
-		Children[action].DisplayValue(history, maxDepth, ostr);
+		DisplayAction(history, action, ostr);
+		Child(action).DisplayValue(arena, history, maxDepth, ostr);
 		history.Pop();
 	}
 }
 
-void VNODE::DisplayPolicy(HISTORY& history, int maxDepth, ostream& ostr) const
+template<class POLICY>
+void VNODE_T<POLICY>::DisplayPolicy(const NODE_ARENA& arena, HISTORY& history, int maxDepth, ostream& ostr) const
 {
 	if (history.Size() >= maxDepth)
 		return;
 
 	double bestq = -Infinity;
 	int besta = -1;
-	for (int action = 0; action < NumChildren; action++)
+	for (int action = 0; action < GetNumChildren(); action++)
 	{
-		if (Children[action].Value.GetValue() > bestq)
+		if (ActionValues[action].GetValue() > bestq)
 		{
 			besta = action;
-			bestq = Children[action].Value.GetValue();
+			bestq = ActionValues[action].GetValue();
 		}
 	}
 
 	if (besta != -1)
 	{
 		history.Add(besta);
-		Children[besta].DisplayPolicy(history, maxDepth, ostr);
+		DisplayAction(history, besta, ostr);
+		Child(besta).DisplayPolicy(arena, history, maxDepth, ostr);
 		history.Pop();
 	}
 }
 
+template<class POLICY>
+void VNODE_T<POLICY>::UnitTest()
+{
+	VNODE_T vnode;
+	vnode.Initialise(4);
+
+	// Values set from prior knowledge read back exactly
+	vnode.SetChildren(LargeInteger, -Infinity);
+	assert(vnode.ActionValue(0).GetValue() == -Infinity);
+	vnode.ActionValue(1).Set(0, 0);
+	vnode.ActionValue(1).Add(1.0);
+	vnode.ActionValue(1).Add(2.0);
+	vnode.ActionValue(1).AddShared(3.0);
+	assert(vnode.ActionValue(1).GetCount() == 3);
+	assert(vnode.ActionValue(1).GetValue() == 2.0);
+	assert(vnode.ActionValue(1).GetVariance() == (HasVariance ? 1.0 : 0));
+	if (HasAMAF)
+	{
+		vnode.ActionAMAF(2).Set(0, 0);
+		vnode.ActionAMAF(2).Add(4.0, 0.5);
+		assert(vnode.ActionAMAF(2).GetValue() == 4.0);
+	}
+
+	// No policy keeps more than the full statistics
+	VNODE_T<FULL_STATISTICS> full;
+	full.Initialise(4);
+	assert(vnode.GetBytes() <= full.GetBytes());
+}
+
+template class VNODE_T<FULL_STATISTICS>;
+template class VNODE_T<COMPACT_STATISTICS>;
+
+//-----------------------------------------------------------------------------
+
+template<class T>
+NODE_STORE<T>::NODE_STORE()
+	: NumUsed(0),
+	NumFree(0),
+	FreeHead(0)
+{
+	for (int i = 0; i < MaxChunks; i++)
+		Chunks[i] = 0;
+}
+
+template<class T>
+NODE_STORE<T>::~NODE_STORE()
+{
+	for (int i = 0; i < MaxChunks; i++)
+	{
+		if (!Chunks[i])
+			continue;
+		for (uint32_t j = 0; j < (FirstChunkSize << i); j++)
+			Chunks[i][j].~T();
+		PAGES::Free(Blocks[i]);
+	}
+}
+
+template<class T>
+T* NODE_STORE<T>::Create()
+{
+	uint64_t head = AtomicLoad(FreeHead);
+	while (HeadHandle(head))
+	{
+		// A stale NextFree is harmless, the tag will have moved on
+		T* node = Get(HeadHandle(head));
+		uint64_t next = MakeHead((head >> 32) + 1, AtomicLoad(node->NextFree));
+		if (AtomicCompareExchange(FreeHead, head, next))
+		{
+			NumFree--;
+			return node;
+		}
+	}
+
+	NODE_HANDLE handle = ++NumUsed;
+	assert(handle);
+	uint32_t index = handle - 1 + FirstChunkSize;
+	int chunk = 31 - __builtin_clz(index) - LogFirstChunkSize;
+	if (!AtomicLoad(Chunks[chunk]))
+	{
+		// Chunks are made once and kept until the store is destroyed
+		lock_guard<mutex> lock(ChunkMutex);
+		if (!Chunks[chunk])
+		{
+			uint32_t size = FirstChunkSize << chunk;
+			Blocks[chunk] = PAGES::Allocate(size * sizeof(T), true);
+			T* nodes = reinterpret_cast<T*>(Blocks[chunk].Memory);
+			for (uint32_t j = 0; j < size; j++)
+				new (&nodes[j]) T;
+			AtomicStore(Chunks[chunk], nodes);
+		}
+	}
+
+	T* node = Get(handle);
+	node->Handle = handle;
+	return node;
+}
+
+template<class T>
+void NODE_STORE<T>::Free(const vector<T*>& nodes)
+{
+	if (nodes.empty())
+		return;
+
+	// Linked in order, so the last node given is on top
+	for (int i = 1; i < (int) nodes.size(); i++)
+		AtomicStore(nodes[i]->NextFree, nodes[i - 1]->Handle);
+	uint64_t head = AtomicLoad(FreeHead);
+	do
+		AtomicStore(nodes.front()->NextFree, HeadHandle(head));
+	while (!AtomicCompareExchange(FreeHead, head, MakeHead((head >> 32) + 1, nodes.back()->Handle)));
+	NumFree += nodes.size();
+}
+
+template<class T>
+void NODE_STORE<T>::Reset()
+{
+	NumUsed = 0;
+	NumFree = 0;
+	FreeHead = 0;
+}
+
+template<class T>
+size_t NODE_STORE<T>::GetBytes() const
+{
+	size_t bytes = 0;
+	for (int i = 0; i < MaxChunks; i++)
+		if (Chunks[i])
+			bytes += (FirstChunkSize << i) * sizeof(T);
+	return bytes;
+}
+
+template class NODE_STORE<VNODE>;
+template class NODE_STORE<QNODE>;
+
+//-----------------------------------------------------------------------------
+
+VNODE* NODE_ARENA::Create(int numActions)
+{
+	// Nodes from an earlier tree keep their storage, which Initialise reuses
+	VNODE* vnode = VNodes.Create();
+	vnode->Initialise(numActions);
+	return vnode;
+}
+
+void NODE_ARENA::Free(VNODE* vnode, const SIMULATOR& simulator)
+{
+	vector<VNODE*> freed;
+	vector<QNODE*> freedChildren;
+	vector<VNODE*> open(1, vnode);
+	while (!open.empty())
+	{
+		VNODE* node = open.back();
+		open.pop_back();
+		for (int action = 0; action < node->GetNumChildren(); action++)
+		{
+			QNODE* qnode = node->Children[action];
+			if (!qnode)
+				continue;
+			const CHILD_MAP& children = qnode->ChildMap;
+			for (int slot = 0; slot < children.GetNumSlots(); slot++)
+				if (children.GetChild(slot))
+					open.push_back(Get(children.GetChild(slot)));
+			node->Children[action] = 0;
+			qnode->Initialise();
+			freedChildren.push_back(qnode);
+		}
+		node->BeliefState.Free(simulator);
+		freed.push_back(node);
+	}
+	QNodes.Free(freedChildren);
+	VNodes.Free(freed);
+}
+
+void NODE_ARENA::Discard(VNODE* vnode)
+{
+	// Never published, so no other thread can hold a reference to it
+	assert(vnode->BeliefState.Empty());
+	for (int action = 0; action < vnode->GetNumChildren(); action++)
+		if (vnode->Children[action])
+			DiscardChild(vnode->Children[action]);
+	VNodes.Free(vnode);
+}
+
+void NODE_ARENA::Reset()
+{
+	// Dropped nodes still point to their QNODEs, until Create clears them
+	VNodes.Reset();
+	QNodes.Reset();
+}
+
+QNODE* NODE_ARENA::CreateChild()
+{
+	// Storage is kept while free, a QNODE from an earlier tree may still
+	// hold its children
+	QNODE* qnode = QNodes.Create();
+	qnode->Initialise();
+	return qnode;
+}
+
+void NODE_ARENA::DiscardChild(QNODE* qnode)
+{
+	qnode->Initialise();
+	QNodes.Free(qnode);
+}
+
+size_t NODE_ARENA::GetBytes() const
+{
+	return VNodes.GetBytes() + QNodes.GetBytes();
+}
+
+void NODE_ARENA::UnitTest()
+{
+	NODE_ARENA arena;
+	TEST_SIMULATOR testSimulator(2, 4, 1);
+	assert(arena.Get(0) == 0);
+
+	// Handles resolve to the same node across chunks of every size
+	vector<VNODE*> nodes;
+	const int numNodes = 3 * NODE_STORE<VNODE>::FirstChunkSize + 5;
+	for (int i = 0; i < numNodes; i++)
+	{
+		nodes.push_back(arena.Create(2));
+		assert(nodes[i]->GetHandle() == NODE_HANDLE(i + 1));
+	}
+	for (int i = 0; i < numNodes; i++)
+		assert(arena.Get(i + 1) == nodes[i]);
+	assert(arena.GetNumAllocated() == numNodes);
+
+	// Actions have a QNODE only once tried
+	assert(!nodes[0]->FindChild(1) && !nodes[0]->Child(1).Child(0));
+	QNODE& qnode = nodes[0]->Child(1, arena);
+	assert(&nodes[0]->Child(1, arena) == &qnode && nodes[0]->FindChild(1) == &qnode);
+	assert(arena.GetNumChildren() == 1);
+
+	// Freed nodes are reused before new ones, and their QNODEs go too
+	qnode.SetChild(0, nodes[1]->GetHandle());
+	nodes[1]->Child(0, arena).SetChild(3, nodes[2]->GetHandle());
+	arena.Discard(nodes[numNodes - 1]);
+	arena.Free(nodes[0], testSimulator);
+	assert(arena.GetNumAllocated() == numNodes - 4);
+	assert(arena.GetNumChildren() == 0);
+	for (int i = 0; i < 4; i++)
+		assert(arena.Create(2)->GetHandle() <= NODE_HANDLE(numNodes));
+	assert(arena.GetNumAllocated() == numNodes);
+
+	// Reset drops every node at once, and the storage is kept
+	nodes[0]->Child(1, arena).SetChild(2, nodes[1]->GetHandle());
+	size_t bytes = arena.GetBytes();
+	arena.Reset();
+	assert(arena.GetNumAllocated() == 0 && arena.GetNumChildren() == 0);
+	VNODE* vnode = arena.Create(3);
+	assert(vnode == nodes[0] && vnode->GetNumChildren() == 3);
+	assert(!vnode->FindChild(1) && !vnode->Child(1, arena).Child(2));
+	assert(arena.GetBytes() == bytes);
+
+	// Threads creating and discarding nodes at once never share a handle
+	const int numThreads = 4, numKept = 50;
+	vector<vector<VNODE*> > kept(numThreads);
+	vector<thread> threads;
+	for (int t = 0; t < numThreads; t++)
+	{
+		threads.push_back(thread([&arena, &kept, t]()
+		{
+			for (int i = 0; i < 1000; i++)
+			{
+				VNODE* node = arena.Create(2);
+				if (i % 20 == 0)
+					kept[t].push_back(node);
+				else
+					arena.Discard(node);
+			}
+		}));
+	}
+	for (int t = 0; t < numThreads; t++)
+		threads[t].join();
+	vector<NODE_HANDLE> handles(1, vnode->GetHandle());
+	for (int t = 0; t < numThreads; t++)
+		for (int i = 0; i < numKept; i++)
+			handles.push_back(kept[t][i]->GetHandle());
+	sort(handles.begin(), handles.end());
+	assert(unique(handles.begin(), handles.end()) == handles.end());
+	assert(arena.GetNumAllocated() == 1 + numThreads * numKept);
+}
+
 //-----------------------------------------------------------------------------
@@ -2,13 +2,22 @@
 #define NODE_H
 
 #include "beliefstate.h"
+#include "memorypool.h"
 #include "utils.h"
+#include <assert.h>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <stdint.h>
 
 class HISTORY;
 class SIMULATOR;
 class QNODE;
-class VNODE;
+class NODE_ARENA;
+template<class T> class NODE_STORE;
+
+// Index of a node in its NODE_STORE, 0 for no node
+typedef uint32_t NODE_HANDLE;
 
 //-----------------------------------------------------------------------------
 // Efficient computation of value from alpha vectors
@@ -20,24 +29,60 @@ struct ALPHA
 };
 
 //-----------------------------------------------------------------------------
+// What the tree keeps for every action, chosen at compile time by the
+// policy parameter of VNODE_T. Accumulators may be single precision,
+// the squared returns are only needed for the variance (early stopping and
+// episode budgets), and AMAF statistics only for RAVE.
 
-template<class COUNT>
-class VALUE
+template<class ACCUMULATOR_TYPE, bool VARIANCE, bool AMAF>
+struct STATISTICS
+{
+	typedef ACCUMULATOR_TYPE ACCUMULATOR;
+	static const bool Variance = VARIANCE;
+	static const bool Amaf = AMAF;
+};
+
+typedef STATISTICS<double, true, true> FULL_STATISTICS;
+typedef STATISTICS<float, false, false> COMPACT_STATISTICS;
+
+#ifdef COMPACT_TREE
+typedef COMPACT_STATISTICS TREE_STATISTICS;
+#else
+typedef FULL_STATISTICS TREE_STATISTICS;
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Statistics of the returns from one node or action, kept in fields
+// stored elsewhere, such as in the arrays of VALUES. Without VARIANCE
+// there are no squared returns and the variance reads as zero.
+
+template<class COUNT, class TOTAL = double, bool VARIANCE = true>
+class VALUE_REF
 {
 public:
 
+	VALUE_REF(COUNT& count, TOTAL& total, TOTAL* squaredTotal)
+		: Count(count),
+		Total(total),
+		SquaredTotal(squaredTotal)
+	{
+	}
+
 	void Set(double count, double value)
 	{
 		Count = count;
 		Total = value * count;
-		SquaredTotal = value*value*count;
+		if (VARIANCE)
+			*SquaredTotal = value*value*count;
 	}
 
 	void Add(double totalReward)
 	{
 		Count += 1.0;
 		Total += totalReward;
-		SquaredTotal += totalReward*totalReward;
+		if (VARIANCE)
+			*SquaredTotal += totalReward*totalReward;
 	}
 
 	void Add(double totalReward, COUNT weight)
@@ -46,19 +91,108 @@ public:
 		Total += totalReward * weight;
 	}
 
+	// Thread-safe updates for searches sharing one tree
+	void AddShared(double totalReward)
+	{
+		UTILS::AtomicAdd(Count, 1);
+		UTILS::AtomicAdd(Total, totalReward);
+		if (VARIANCE)
+			UTILS::AtomicAdd(*SquaredTotal, totalReward*totalReward);
+	}
+
+	void AddShared(double totalReward, COUNT weight)
+	{
+		UTILS::AtomicAdd(Count, weight);
+		UTILS::AtomicAdd(Total, totalReward * weight);
+	}
+
+	// Pending visit counted as a return of -loss until it is removed
+	void AddVirtualLoss(double loss)
+	{
+		AddShared(-loss);
+	}
+
+	void RemoveVirtualLoss(double loss)
+	{
+		UTILS::AtomicAdd(Count, -1);
+		UTILS::AtomicAdd(Total, loss);
+		if (VARIANCE)
+			UTILS::AtomicAdd(*SquaredTotal, -loss*loss);
+	}
+
+	// Add the statistics gathered by value since it was copied from base
+	void Merge(const VALUE_REF& value, const VALUE_REF& base)
+	{
+		Count += value.Count - base.Count;
+		Total += value.Total - base.Total;
+		if (VARIANCE)
+			*SquaredTotal += *value.SquaredTotal - *base.SquaredTotal;
+	}
+
+	// Divided in the precision of the accumulator, so that values set
+	// from prior knowledge read back exactly
 	double GetValue() const
 	{
-		return Count == 0 ? Total : Total / Count;
+		COUNT count = UTILS::AtomicLoad(Count);
+		TOTAL total = UTILS::AtomicLoad(Total);
+		return count == 0 ? total : total / count;
 	}
 
 	COUNT GetCount() const
 	{
-		return Count;
+		return UTILS::AtomicLoad(Count);
 	}
 
 	double GetSquaredValue() const
 	{
-		return SquaredTotal;
+		return VARIANCE ? *SquaredTotal : 0;
+	}
+
+	// Unbiased variance of the returns
+	double GetVariance() const
+	{
+		COUNT count = UTILS::AtomicLoad(Count);
+		if (!VARIANCE || count < 2)
+			return 0;
+		double mean = UTILS::AtomicLoad(Total) / count;
+		double variance = (UTILS::AtomicLoad(*SquaredTotal) - count * mean * mean) / (count - 1);
+		return variance > 0 ? variance : 0;
+	}
+
+private:
+
+	COUNT& Count;
+	TOTAL& Total;
+	TOTAL* SquaredTotal; // only with VARIANCE
+};
+
+//-----------------------------------------------------------------------------
+// Statistics of the returns kept in its own fields
+
+template<class COUNT>
+class VALUE
+{
+public:
+
+	void Set(double count, double value) { Ref().Set(count, value); }
+	void Add(double totalReward) { Ref().Add(totalReward); }
+	void Add(double totalReward, COUNT weight) { Ref().Add(totalReward, weight); }
+	void AddShared(double totalReward) { Ref().AddShared(totalReward); }
+	void AddShared(double totalReward, COUNT weight) { Ref().AddShared(totalReward, weight); }
+	void AddVirtualLoss(double loss) { Ref().AddVirtualLoss(loss); }
+	void RemoveVirtualLoss(double loss) { Ref().RemoveVirtualLoss(loss); }
+	void Merge(const VALUE& value, const VALUE& base) { Ref().Merge(value.Ref(), base.Ref()); }
+
+	double GetValue() const { return Ref().GetValue(); }
+	COUNT GetCount() const { return Ref().GetCount(); }
+	double GetSquaredValue() const { return Ref().GetSquaredValue(); }
+	double GetVariance() const { return Ref().GetVariance(); }
+
+	VALUE_REF<COUNT> Ref() { return VALUE_REF<COUNT>(Count, Total, &SquaredTotal); }
+	const VALUE_REF<COUNT> Ref() const
+	{
+		VALUE& value = const_cast<VALUE&>(*this);
+		return VALUE_REF<COUNT>(value.Count, value.Total, &value.SquaredTotal);
 	}
 
 private:
@@ -69,62 +203,316 @@ private:
 };
 
 //-----------------------------------------------------------------------------
+// Statistics of every action of a node, with one contiguous array per
+// field, so that selection reads only the counts and totals it needs
 
-class QNODE
+template<class COUNT, class TOTAL = double, bool VARIANCE = true>
+class VALUES
 {
 public:
 
-	VALUE<int> Value;
-	VALUE<double> AMAF;
+	typedef VALUE_REF<COUNT, TOTAL, VARIANCE> REF;
+
+	void Resize(int size)
+	{
+		Counts.assign(size, 0);
+		Totals.assign(size, 0);
+		if (VARIANCE)
+			SquaredTotals.assign(size, 0);
+	}
+
+	REF operator[](int i)
+	{
+		return REF(Counts[i], Totals[i], VARIANCE ? &SquaredTotals[i] : 0);
+	}
+
+	const REF operator[](int i) const
+	{
+		return const_cast<VALUES&>(*this)[i];
+	}
+
+	int Size() const { return Counts.size(); }
+	const COUNT* GetCounts() const { return &Counts[0]; }
+	const TOTAL* GetTotals() const { return &Totals[0]; }
+	size_t GetBytes() const { return Size() * (sizeof(COUNT) + (VARIANCE ? 2 : 1) * sizeof(TOTAL)); }
+
+private:
+
+	std::vector<COUNT> Counts;
+	std::vector<TOTAL> Totals;
+	std::vector<TOTAL> SquaredTotals;
+};
+
+//-----------------------------------------------------------------------------
+
+// Children of a QNODE, keyed by observation, holding only the observations
+// actually reached. A few children are stored inline, and the rest in an
+// open-addressed table that doubles as it fills. Each observation and its
+// child share one word, so a child is published by a compare-exchange.
+// Find is safe alongside Publish, so a shared tree can be read while it
+// grows, and only growing the table takes the lock of the map.
+// Tables replaced while the tree is shared are kept until Clear, as other
+// threads may still be reading them.
+
+class CHILD_MAP
+{
+public:
+
+	CHILD_MAP();
+	CHILD_MAP(const CHILD_MAP&); // copies start empty
+	~CHILD_MAP();
+
+	NODE_HANDLE Find(int observation) const;
+
+	// Add, replace or (with no child) detach a child, only one thread
+	// may call Set at a time, and not while others Publish
+	void Set(int observation, NODE_HANDLE child);
+
+	// Add a child unless the observation already has one, returning the
+	// child it then has. Any number of threads may Publish at once.
+	NODE_HANDLE Publish(int observation, NODE_HANDLE child);
+
+	void Clear();
+
+	// Slots in no particular order, empty slots have no child
+	int GetNumSlots() const { return NumInline + (Table ? Table->Capacity : 0); }
+	int GetObservation(int slot) const;
+	NODE_HANDLE GetChild(int slot) const;
+
+	// Memory allocated outside the owning node
+	size_t GetHeapBytes() const;
+
+	static void UnitTest();
+
+private:
+
+	static const int NumInline = 4;
+
+	// Observation plus one in the high half and child in the low half,
+	// so that an empty slot is zero. Sealed slots are empty slots of a
+	// table being replaced.
+	typedef uint64_t ENTRY;
+	static const ENTRY Sealed = ~ENTRY(0);
+	static ENTRY MakeEntry(int observation, NODE_HANDLE child) { return (ENTRY(observation + 1) << 32) | child; }
+	static int EntryObservation(ENTRY entry) { return int(entry >> 32) - 1; }
+	static NODE_HANDLE EntryChild(ENTRY entry) { return NODE_HANDLE(entry); }
+
+	struct TABLE
+	{
+		TABLE(int capacity);
+		~TABLE();
+
+		int Capacity, Size;
+		std::vector<ENTRY> Entries;
+		TABLE* Retired; // replaced tables still visible to other threads
+	};
+
+	// Slot holding observation, or else the first empty slot, or -1
+	static int Probe(const TABLE& table, int observation);
+	static NODE_HANDLE Claim(ENTRY& slot, int observation, NODE_HANDLE child, bool& filled);
+	NODE_HANDLE Insert(int observation, NODE_HANDLE child, bool shared);
+	void Grow(TABLE* full, bool shared);
+
+	ENTRY InlineEntries[NumInline];
+	TABLE* Table;
+	UTILS::SPIN_LOCK GrowLock;
+};
+
+//-----------------------------------------------------------------------------
+
+// Observation children of one action, its statistics are held by the VNODE.
+// QNODEs are made by the NODE_ARENA when their action is first tried.
+
+class QNODE
+{
+public:
 
 	void Initialise();
 
-	VNODE*& Child(int c) { return Children[c]; }
-	VNODE* Child(int c) const { return Children[c]; }
+	// Stands in for the actions of a node that have not been tried
+	static const QNODE& Untried();
+
+	NODE_HANDLE Child(int c) const { return ChildMap.Find(c); }
+	void SetChild(int c, NODE_HANDLE child) { ChildMap.Set(c, child); }
+	NODE_HANDLE PublishChild(int c, NODE_HANDLE child) { return ChildMap.Publish(c, child); }
+	const CHILD_MAP& GetChildren() const { return ChildMap; }
 	ALPHA& Alpha() { return AlphaData; }
 	const ALPHA& Alpha() const { return AlphaData; }
 
-	void DisplayValue(HISTORY& history, int maxDepth, std::ostream& ostr) const;
-	void DisplayPolicy(HISTORY& history, int maxDepth, std::ostream& ostr) const;
+	void DisplayValue(const NODE_ARENA& arena, HISTORY& history, int maxDepth, std::ostream& ostr) const;
+	void DisplayPolicy(const NODE_ARENA& arena, HISTORY& history, int maxDepth, std::ostream& ostr) const;
 
-	static int NumChildren;
 private:
 
-	std::vector<VNODE*> Children;
+	NODE_HANDLE Handle;
+	NODE_HANDLE NextFree; // below this node on the free stack of its store
+	CHILD_MAP ChildMap;
 	ALPHA AlphaData;
-	friend class VNODE;
+	template<class POLICY> friend class VNODE_T;
+	friend class NODE_ARENA;
+	friend class NODE_STORE<QNODE>;
 };
 
 //-----------------------------------------------------------------------------
 
-class VNODE : public MEMORY_OBJECT
+template<class POLICY>
+class VNODE_T
 {
 public:
+	typedef typename POLICY::ACCUMULATOR ACCUMULATOR;
+	typedef VALUES<int, ACCUMULATOR, POLICY::Variance> ACTION_VALUES;
+	typedef VALUES<ACCUMULATOR, ACCUMULATOR, false> ACTION_AMAFS;
+	typedef typename ACTION_VALUES::REF ACTION_VALUE;
+	typedef typename ACTION_AMAFS::REF ACTION_AMAF;
+	static const bool HasVariance = POLICY::Variance;
+	static const bool HasAMAF = POLICY::Amaf;
+
 	VALUE<int> Value;
-	void Initialise();
-	static VNODE* Create();
-	static void Free(VNODE* vnode, const SIMULATOR& simulator);
-	static void FreeAll();
+	void Initialise(int numActions);
+
+	NODE_HANDLE GetHandle() const { return Handle; }
+	int GetNumChildren() const { return Children.size(); }
 
-	QNODE& Child(int c) { return Children[c]; }
-	const QNODE& Child(int c) const { return Children[c]; }
+	// Actions have no QNODE until first tried, only their statistics,
+	// and until then read as an action with no children
+	QNODE* FindChild(int c) const { return UTILS::AtomicLoad(Children[c]); }
+	const QNODE& Child(int c) const { QNODE* qnode = FindChild(c); return qnode ? *qnode : QNODE::Untried(); }
+	QNODE& Child(int c, NODE_ARENA& arena);
+	ACTION_VALUE ActionValue(int c) { return ActionValues[c]; }
+	const ACTION_VALUE ActionValue(int c) const { return ActionValues[c]; }
+	ACTION_AMAF ActionAMAF(int c) { assert(HasAMAF); return ActionAMAFs[c]; }
+	const ACTION_AMAF ActionAMAF(int c) const { assert(HasAMAF); return ActionAMAFs[c]; }
+	const ACTION_VALUES& GetActionValues() const { return ActionValues; }
+	const ACTION_AMAFS& GetActionAMAFs() const { return ActionAMAFs; }
 	BELIEF_STATE& Beliefs() { return BeliefState; }
 	const BELIEF_STATE& Beliefs() const { return BeliefState; }
+	UTILS::SPIN_LOCK& BeliefsLock() { return BeliefLock; } // for shared trees
 	void setBeliefs(BELIEF_STATE& newBelief)
 	{
 		BeliefState = newBelief;
 	}
 
 	void SetChildren(int count, double value);
+	void CopyStatistics(const VNODE_T& vnode);
+
+	// Memory used by the node and its actions, not counting child nodes
+	// or the states of its particles
+	size_t GetBytes() const;
+
+	void DisplayValue(const NODE_ARENA& arena, HISTORY& history, int maxDepth, std::ostream& ostr) const;
+	void DisplayPolicy(const NODE_ARENA& arena, HISTORY& history, int maxDepth, std::ostream& ostr) const;
 
-	void DisplayValue(HISTORY& history, int maxDepth, std::ostream& ostr) const;
-	void DisplayPolicy(HISTORY& history, int maxDepth, std::ostream& ostr) const;
+	static void UnitTest();
 
-	static int NumChildren;
 private:
-	std::vector<QNODE> Children;
+	NODE_HANDLE Handle;
+	NODE_HANDLE NextFree; // below this node on the free stack of its store
+	std::vector<QNODE*> Children; // owned by the arena, 0 until tried
+	ACTION_VALUES ActionValues;
+	ACTION_AMAFS ActionAMAFs; // empty without AMAF
 	BELIEF_STATE BeliefState;
-	static MEMORY_POOL<VNODE> VNodePool;
+	UTILS::SPIN_LOCK BeliefLock;
+	void DisplayAction(HISTORY& history, int action, std::ostream& ostr) const;
+	friend class NODE_ARENA;
+	friend class NODE_STORE<VNODE_T>;
+};
+
+// Nodes of the search tree, with the statistics selected for this build
+typedef VNODE_T<TREE_STATISTICS> VNODE;
+
+//-----------------------------------------------------------------------------
+// Storage for nodes of one type, addressed by 32-bit handles, where 0 is
+// no node. Nodes live in chunks that double in size and never move, so
+// handles and pointers stay valid until the store is destroyed. Nodes may
+// be created and freed by several threads at once. Freed handles go on a
+// lock-free stack and are reused, last freed first, before new ones.
+// The stack head is tagged with a count of its changes, so a thread that
+// has read a stale head always fails its compare-exchange. The node type
+// provides the Handle and NextFree fields.
+
+template<class T>
+class NODE_STORE
+{
+public:
+
+	NODE_STORE();
+	~NODE_STORE();
+
+	// Node with its handle set, holding whatever it held when last freed
+	T* Create();
+
+	T* Get(NODE_HANDLE handle) const
+	{
+		if (!handle)
+			return 0;
+		uint32_t index = handle - 1 + FirstChunkSize;
+		int chunk = 31 - __builtin_clz(index);
+		return UTILS::AtomicLoad(Chunks[chunk - LogFirstChunkSize]) + (index - (1u << chunk));
+	}
+
+	void Free(T* node) { Free(std::vector<T*>(1, node)); }
+	void Free(const std::vector<T*>& nodes);
+
+	// Free every node at once, without any other thread using the store
+	void Reset();
+
+	int GetNumAllocated() const { return NumUsed - NumFree; }
+	size_t GetBytes() const;
+
+	static const int LogFirstChunkSize = 8;
+	static const uint32_t FirstChunkSize = 1u << LogFirstChunkSize;
+
+private:
+
+	static NODE_HANDLE HeadHandle(uint64_t head) { return NODE_HANDLE(head); }
+	static uint64_t MakeHead(uint64_t tag, NODE_HANDLE handle) { return (tag << 32) | handle; }
+
+	static const int MaxChunks = 32 - LogFirstChunkSize;
+
+	T* Chunks[MaxChunks];
+	PAGES::BLOCK Blocks[MaxChunks]; // large chunks are backed by huge pages
+	std::atomic<uint32_t> NumUsed; // handles handed out since the last reset
+	std::atomic<int> NumFree;
+	uint64_t FreeHead; // tag in the high half, top handle in the low half
+	std::mutex ChunkMutex; // only taken to make a new chunk
+};
+
+//-----------------------------------------------------------------------------
+// Storage for the nodes of one search tree. Reset discards every node at
+// once, and keeps the chunks for the next tree. The QNODEs of tried
+// actions come from a store of their own, and go with their VNODE.
+
+class NODE_ARENA
+{
+public:
+
+	VNODE* Create(int numActions);
+
+	VNODE* Get(NODE_HANDLE handle) const { return VNodes.Get(handle); }
+
+	// Free a subtree, along with the particles of its nodes
+	void Free(VNODE* vnode, const SIMULATOR& simulator);
+
+	// Return a node that was never published in the tree
+	void Discard(VNODE* vnode);
+
+	// Discard every node, their particles must already have been freed
+	void Reset();
+
+	// QNODE for a newly tried action, and its return when not published
+	QNODE* CreateChild();
+	void DiscardChild(QNODE* qnode);
+
+	int GetNumAllocated() const { return VNodes.GetNumAllocated(); }
+	int GetNumChildren() const { return QNodes.GetNumAllocated(); } // QNODEs in use
+	size_t GetBytes() const;
+
+	static void UnitTest();
+
+private:
+
+	NODE_STORE<VNODE> VNodes;
+	NODE_STORE<QNODE> QNodes;
 };
 
 #endif // NODE_H
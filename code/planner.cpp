@@ -0,0 +1,315 @@
+#include "planner.h"
+#include "testsimulator.h"
+#include <assert.h>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	double Milliseconds(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+	{
+		return chrono::duration<double, milli>(end - start).count();
+	}
+}
+
+PLANNER::STATS::STATS()
+	: Decisions(0),
+	NumNodes(0),
+	NumParticles(0),
+	Bytes(0),
+	PeakBytes(0)
+{
+}
+
+PLANNER::SESSION::SESSION(const SIMULATOR& simulator, const MCTS::PARAMS& params,
+	const RANDOM& random)
+	: Simulator(simulator),
+	Params(params),
+	Mcts(0),
+	Random(random),
+	Decisions(0),
+	Scheduled(false),
+	Closing(false)
+{
+	// Sessions are the unit of parallelism, so each one searches on a
+	// single thread and never in the background
+	Params.Parallel = MCTS::PARAMS::PARALLEL_NONE;
+	Params.NumThreads = 1;
+	Params.Ponder = false;
+	Params.DeferTeardown = false;
+}
+
+PLANNER::SESSION::~SESSION()
+{
+	delete Mcts;
+}
+
+PLANNER::PLANNER(int numThreads)
+	: NextSession(0),
+	Pending(0),
+	Stop(false)
+{
+	assert(numThreads > 0);
+	for (int i = 0; i < numThreads; i++)
+		Threads.push_back(thread(&PLANNER::WorkerLoop, this));
+}
+
+PLANNER::~PLANNER()
+{
+	Wait();
+	{
+		lock_guard<mutex> lock(Mutex);
+		Stop = true;
+	}
+	Wake.notify_all();
+	for (int i = 0; i < Threads.size(); i++)
+		Threads[i].join();
+	for (map<int, SESSION*>::iterator i = Sessions.begin(); i != Sessions.end(); ++i)
+		delete i->second;
+}
+
+int PLANNER::Open(const SIMULATOR& simulator, const MCTS::PARAMS& params)
+{
+	// Streams are keyed by session, so results do not depend on scheduling
+	uint64_t seed = RANDOM::Thread().Next();
+	lock_guard<mutex> lock(Mutex);
+	int session = NextSession++;
+	Sessions[session] = new SESSION(simulator, params, RANDOM(seed, session));
+	return session;
+}
+
+future<int> PLANNER::SelectAction(int session)
+{
+	shared_ptr<promise<int> > decision = make_shared<promise<int> >();
+	SelectAction(session, [decision](int action) { decision->set_value(action); });
+	return decision->get_future();
+}
+
+void PLANNER::SelectAction(int session, const DECISION& decision)
+{
+	Post(session, [decision](SESSION& s)
+	{
+		int action = s.Mcts->SelectAction();
+		s.Decisions++;
+		decision(action);
+	});
+}
+
+future<bool> PLANNER::Update(int session, int action, int observation, double reward)
+{
+	shared_ptr<promise<bool> > result = make_shared<promise<bool> >();
+	Post(session, [=](SESSION& s)
+	{
+		result->set_value(s.Mcts->Update(action, observation, reward));
+	});
+	return result->get_future();
+}
+
+void PLANNER::Close(int session)
+{
+	SESSION* closed = 0;
+	{
+		lock_guard<mutex> lock(Mutex);
+		assert(Sessions.count(session));
+		SESSION* s = Sessions[session];
+		s->Closing = true;
+		Sessions.erase(session);
+
+		// A busy session is freed by the worker serving its last request
+		if (!s->Scheduled)
+			closed = s;
+	}
+	delete closed;
+}
+
+void PLANNER::Wait()
+{
+	unique_lock<mutex> lock(Mutex);
+	while (Pending > 0)
+		Idle.wait(lock);
+}
+
+PLANNER::STATS PLANNER::GetStats(int session) const
+{
+	lock_guard<mutex> lock(Mutex);
+	map<int, SESSION*>::const_iterator i = Sessions.find(session);
+	assert(i != Sessions.end());
+	return i->second->Stats;
+}
+
+int PLANNER::GetNumSessions() const
+{
+	lock_guard<mutex> lock(Mutex);
+	return Sessions.size();
+}
+
+void PLANNER::Post(int session, const REQUEST& request)
+{
+	{
+		lock_guard<mutex> lock(Mutex);
+		map<int, SESSION*>::iterator i = Sessions.find(session);
+		assert(i != Sessions.end());
+		SESSION& s = *i->second;
+		s.Requests.push_back(make_pair(request, chrono::steady_clock::now()));
+		Pending++;
+		if (s.Scheduled)
+			return;
+		s.Scheduled = true;
+		Ready.push_back(&s);
+	}
+	Wake.notify_one();
+}
+
+void PLANNER::WorkerLoop()
+{
+	unique_lock<mutex> lock(Mutex);
+	while (true)
+	{
+		while (!Stop && Ready.empty())
+			Wake.wait(lock);
+		if (Stop)
+			return;
+
+		// Serve one request, then requeue the session behind the others
+		SESSION& session = *Ready.front();
+		Ready.pop_front();
+		REQUEST request = session.Requests.front().first;
+		chrono::steady_clock::time_point queued = session.Requests.front().second;
+		session.Requests.pop_front();
+
+		lock.unlock();
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		Serve(session, request);
+		chrono::steady_clock::time_point end = chrono::steady_clock::now();
+		STATS footprint;
+		Measure(*session.Mcts, footprint);
+		lock.lock();
+
+		STATS& stats = session.Stats;
+		stats.QueueTime.Add(Milliseconds(queued, start));
+		stats.ServiceTime.Add(Milliseconds(start, end));
+		stats.Decisions = session.Decisions;
+		stats.NumNodes = footprint.NumNodes;
+		stats.NumParticles = footprint.NumParticles;
+		stats.Bytes = footprint.Bytes;
+		stats.PeakBytes = max(stats.PeakBytes, stats.Bytes);
+		if (!session.Requests.empty())
+		{
+			Ready.push_back(&session);
+			Wake.notify_one();
+		}
+		else
+		{
+			session.Scheduled = false;
+			if (session.Closing)
+			{
+				lock.unlock();
+				delete &session;
+				lock.lock();
+			}
+		}
+		if (--Pending == 0)
+			Idle.notify_all();
+	}
+}
+
+void PLANNER::Serve(SESSION& session, const REQUEST& request)
+{
+	// Run on the random stream of the session
+	RANDOM& random = RANDOM::Thread();
+	RANDOM saved = random;
+	random = session.Random;
+
+	if (!session.Mcts)
+		session.Mcts = new MCTS(session.Simulator, session.Params);
+	request(session);
+
+	session.Random = random;
+	random = saved;
+}
+
+void PLANNER::Measure(const MCTS& mcts, STATS& stats)
+{
+	// Counted by the arena rather than by walking the tree, which would
+	// cost as much as the search on every request. Only the root and its
+	// children hold particles.
+	stats.NumNodes = mcts.Arena->GetNumAllocated();
+	stats.Bytes = mcts.GetTreeBytes();
+	const VNODE* root = mcts.Root;
+	stats.NumParticles = root->Beliefs().GetNumSamples();
+	for (int action = 0; action < root->GetNumChildren(); action++)
+	{
+		const CHILD_MAP& children = root->Child(action).GetChildren();
+		for (int slot = 0; slot < children.GetNumSlots(); slot++)
+			if (children.GetChild(slot))
+				stats.NumParticles += mcts.Arena->Get(children.GetChild(slot))->Beliefs().GetNumSamples();
+	}
+}
+
+void PLANNER::UnitTest()
+{
+	TEST_SIMULATOR testSimulator(3, 2, 2);
+	MCTS::PARAMS params;
+	params.MaxDepth = 3;
+	params.NumSimulations = 200;
+	params.NumStartStates = 10;
+	const int numSessions = 8, numSteps = 3;
+
+	// Decisions of a session do not depend on the number of threads
+	vector<vector<int> > actions[2];
+	for (int run = 0; run < 2; run++)
+	{
+		RANDOM::Thread().Seed(1);
+		PLANNER planner(run == 0 ? 1 : 4);
+		vector<int> sessions;
+		for (int i = 0; i < numSessions; i++)
+			sessions.push_back(planner.Open(testSimulator, params));
+		assert(planner.GetNumSessions() == numSessions);
+
+		actions[run].resize(numSessions);
+		for (int step = 0; step < numSteps; step++)
+		{
+			vector<future<int> > decisions;
+			for (int i = 0; i < numSessions; i++)
+				decisions.push_back(planner.SelectAction(sessions[i]));
+			for (int i = 0; i < numSessions; i++)
+			{
+				int action = decisions[i].get();
+				actions[run][i].push_back(action);
+				planner.Update(sessions[i], action, 0, 1.0);
+			}
+		}
+
+		// Callbacks are run by the worker serving the request
+		atomic<int> numCalled(0);
+		for (int i = 0; i < numSessions; i++)
+			planner.SelectAction(sessions[i], [&numCalled](int action) { numCalled++; });
+		planner.Wait();
+		assert(numCalled == numSessions);
+
+		STATS stats = planner.GetStats(sessions[0]);
+		assert(stats.Decisions == numSteps + 1);
+		assert(stats.QueueTime.GetCount() == 2 * numSteps + 1);
+		assert(stats.ServiceTime.GetCount() == 2 * numSteps + 1);
+		assert(stats.NumNodes > 1 && stats.Bytes > 0);
+		assert(stats.PeakBytes >= stats.Bytes);
+
+		// Closing waits for queued requests, or frees an idle session
+		planner.SelectAction(sessions[1]);
+		planner.Close(sessions[1]);
+		planner.Close(sessions[2]);
+		assert(planner.GetNumSessions() == numSessions - 2);
+	}
+
+	for (int i = 0; i < numSessions; i++)
+	{
+		assert(actions[0][i] == actions[1][i]);
+		assert(actions[0][i][0] == 0);
+	}
+}
+
+//-----------------------------------------------------------------------------
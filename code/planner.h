@@ -0,0 +1,107 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "mcts.h"
+#include "random.h"
+#include "statistic.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Asynchronous front end for many independent agents on one host.
+// Each session owns its own search tree, history and beliefs. Requests to
+// a session are queued and run in order, one at a time, while sessions
+// are multiplexed over a fixed set of worker threads, one request per
+// turn. Every session draws from its own random stream, so its decisions
+// do not depend on how the sessions are scheduled.
+
+class PLANNER
+{
+public:
+
+	typedef std::function<void(int)> DECISION; // called with the selected action
+
+	// Latency and memory accounting for one session
+	struct STATS
+	{
+		STATS();
+
+		STATISTIC QueueTime; // milliseconds from request to the start of its service
+		STATISTIC ServiceTime; // milliseconds spent serving each request
+		int Decisions;
+		int NumNodes; // nodes in the tree after the last request
+		int NumParticles; // particles held by the tree after the last request
+		size_t Bytes; // approximate size of the tree after the last request
+		size_t PeakBytes;
+	};
+
+	PLANNER(int numThreads);
+	~PLANNER();
+
+	// Start a session, searching sequentially with params on simulator,
+	// which must outlive the session
+	int Open(const SIMULATOR& simulator, const MCTS::PARAMS& params);
+
+	// Queue a request behind those already made to the session
+	std::future<int> SelectAction(int session);
+	void SelectAction(int session, const DECISION& decision);
+	std::future<bool> Update(int session, int action, int observation, double reward);
+
+	// Free the session once its queued requests have been served
+	void Close(int session);
+
+	// Block until every queued request has been served
+	void Wait();
+
+	STATS GetStats(int session) const;
+	int GetNumSessions() const;
+	int GetNumThreads() const { return Threads.size(); }
+
+	static void UnitTest();
+
+private:
+
+	struct SESSION;
+	typedef std::function<void(SESSION&)> REQUEST;
+
+	struct SESSION
+	{
+		SESSION(const SIMULATOR& simulator, const MCTS::PARAMS& params, const RANDOM& random);
+		~SESSION();
+
+		const SIMULATOR& Simulator;
+		MCTS::PARAMS Params;
+		MCTS* Mcts; // created by the first request served
+		RANDOM Random;
+		int Decisions; // only touched by the worker serving the session
+		std::deque<std::pair<REQUEST, std::chrono::steady_clock::time_point> > Requests;
+		bool Scheduled; // queued for, or being served by, a worker
+		bool Closing;
+		STATS Stats; // guarded by Mutex
+	};
+
+	void Post(int session, const REQUEST& request);
+	void WorkerLoop();
+	void Serve(SESSION& session, const REQUEST& request);
+	static void Measure(const MCTS& mcts, STATS& stats);
+
+	std::map<int, SESSION*> Sessions;
+	std::deque<SESSION*> Ready;
+	std::vector<std::thread> Threads;
+	mutable std::mutex Mutex;
+	std::condition_variable Wake, Idle;
+	int NextSession;
+	int Pending; // requests queued or being served
+	bool Stop;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif // PLANNER_H
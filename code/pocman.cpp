@@ -12,13 +12,14 @@ POCMAN::POCMAN(int xsize, int ysize)
 	FoodProb(0.5),
 	ChaseProb(0.75),
 	DefensiveSlip(0.25),
-	PowerNumSteps(15),
 	RewardClearLevel(+1000),
 	RewardDefault(-1),
 	RewardDie(-100),
 	RewardEatFood(+10),
 	RewardEatGhost(+25),
-	RewardHitWall(-25)
+	RewardHitWall(-25),
+	PowerNumSteps(15),
+	MemoryPool(256, true)
 {
 	NumActions = 4;
 	NumObservations = 1 << 10;
@@ -130,6 +131,11 @@ STATE* POCMAN::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* POCMAN::Clone() const
+{
+	return new POCMAN(*this);
+}
+
 void POCMAN::Validate(const STATE& state) const
 {
 	const POCMAN_STATE& pocstate = safe_cast<const POCMAN_STATE&>(state);
@@ -158,6 +164,11 @@ void POCMAN::FreeState(STATE* state) const
 	MemoryPool.Free(pocstate);
 }
 
+void POCMAN::TrimMemory() const
+{
+	MemoryPool.Trim();
+}
+
 COORD POCMAN::NextPos(const COORD& from, int dir) const
 {
 	COORD nextPos;
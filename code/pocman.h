@@ -23,9 +23,11 @@ class POCMAN : public SIMULATOR
 public:
 
 	virtual STATE* Copy(const STATE& state) const;
+	virtual SIMULATOR* Clone() const;
 	virtual void Validate(const STATE& state) const;
 	virtual STATE* CreateStartState() const;
 	virtual void FreeState(STATE* state) const;
+	virtual void TrimMemory() const;
 	virtual bool Step(STATE& state, int action,
 		int& observation, double& reward) const;
 
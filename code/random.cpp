@@ -0,0 +1,104 @@
+#include "random.h"
+#include <atomic>
+#include <math.h>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	uint64_t SplitMix(uint64_t& x)
+	{
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+}
+
+RANDOM::RANDOM(uint64_t seed, uint64_t stream)
+{
+	Seed(seed, stream);
+}
+
+void RANDOM::Seed(uint64_t seed, uint64_t stream)
+{
+	// Hash the pair so that nearby seeds and streams give unrelated states
+	uint64_t x = seed;
+	x = SplitMix(x) ^ stream;
+	for (int i = 0; i < 4; i++)
+		State[i] = SplitMix(x);
+}
+
+RANDOM RANDOM::Split()
+{
+	RANDOM random = *this;
+	Jump();
+	return random;
+}
+
+void RANDOM::Jump()
+{
+	static const uint64_t JumpPoly[] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+		0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+
+	uint64_t s[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4; i++)
+	{
+		for (int b = 0; b < 64; b++)
+		{
+			if (JumpPoly[i] & (1ULL << b))
+				for (int j = 0; j < 4; j++)
+					s[j] ^= State[j];
+			Next();
+		}
+	}
+	for (int j = 0; j < 4; j++)
+		State[j] = s[j];
+}
+
+uint64_t RANDOM::NewThreadStream()
+{
+	// Threads get streams in the order they first draw a number,
+	// so the main thread is always stream 0
+	static std::atomic<uint64_t> numStreams(0);
+	return numStreams++;
+}
+
+void RANDOM::UnitTest()
+{
+	// Same seed and stream reproduce the sequence
+	RANDOM a(42, 1), b(42, 1), c(42, 2);
+	bool differ = false;
+	for (int i = 0; i < 100; i++)
+	{
+		uint64_t x = a.Next();
+		assert(x == b.Next());
+		differ |= x != c.Next();
+	}
+	assert(differ);
+
+	// Split streams do not repeat the parent
+	RANDOM parent(7);
+	RANDOM child = parent.Split();
+	assert(child.Next() != parent.Next());
+
+	// Bounded integers are in range and roughly uniform
+	int counts[7] = { 0 };
+	for (int i = 0; i < 70000; i++)
+	{
+		int r = a.Random(7);
+		assert(r >= 0 && r < 7);
+		counts[r]++;
+	}
+	for (int r = 0; r < 7; r++)
+		assert(fabs(counts[r] - 10000) < 500);
+
+	for (int i = 0; i < 1000; i++)
+	{
+		double d = a.RandomDouble();
+		assert(d >= 0 && d < 1);
+	}
+}
+
+//-----------------------------------------------------------------------------
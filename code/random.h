@@ -0,0 +1,93 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+#include <assert.h>
+
+//-----------------------------------------------------------------------------
+// xoshiro256** generator with seedable, splittable streams.
+// Every thread has its own generator, so random numbers never contend
+// between threads, and a thread given a (seed, stream) pair reproduces
+// the same sequence whichever core it happens to run on.
+
+class RANDOM
+{
+public:
+
+	RANDOM(uint64_t seed = 0, uint64_t stream = 0);
+
+	// Streams with the same seed and different ids are independent
+	void Seed(uint64_t seed, uint64_t stream = 0);
+
+	// New generator continuing this sequence, while this one jumps
+	// 2^128 steps ahead so the two never overlap
+	RANDOM Split();
+
+	uint64_t Next();
+
+	// Unbiased integer in [0, max)
+	int Random(int max);
+
+	// Uniform double in [0, 1)
+	double RandomDouble();
+
+	// Generator of the calling thread
+	static RANDOM& Thread();
+
+	static void UnitTest();
+
+private:
+
+	void Jump();
+	static uint64_t Rotate(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+	static uint64_t NewThreadStream();
+
+	uint64_t State[4];
+};
+
+inline uint64_t RANDOM::Next()
+{
+	const uint64_t result = Rotate(State[1] * 5, 7) * 9;
+	const uint64_t t = State[1] << 17;
+	State[2] ^= State[0];
+	State[3] ^= State[1];
+	State[1] ^= State[2];
+	State[0] ^= State[3];
+	State[2] ^= t;
+	State[3] = Rotate(State[3], 45);
+	return result;
+}
+
+inline int RANDOM::Random(int max)
+{
+	// Lemire's multiply and reject method, no division in the common case
+	assert(max > 0);
+	uint32_t range = max;
+	uint64_t m = (Next() >> 32) * range;
+	uint32_t low = (uint32_t)m;
+	if (low < range)
+	{
+		uint32_t threshold = -range % range;
+		while (low < threshold)
+		{
+			m = (Next() >> 32) * range;
+			low = (uint32_t)m;
+		}
+	}
+	return m >> 32;
+}
+
+inline double RANDOM::RandomDouble()
+{
+	return (Next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+inline RANDOM& RANDOM::Thread()
+{
+	static thread_local RANDOM random(0, NewThreadStream());
+	return random;
+}
+
+//-----------------------------------------------------------------------------
+
+#endif // RANDOM_H
@@ -0,0 +1,125 @@
+#include "reclaimer.h"
+#include "testsimulator.h"
+#include <assert.h>
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+
+RECLAIMER::RECLAIMER(const SIMULATOR& simulator, NODE_ARENA& arena)
+	: Simulator(simulator),
+	Arena(arena),
+	Pending(0),
+	Stop(false)
+{
+	Thread = thread(&RECLAIMER::WorkerLoop, this);
+}
+
+RECLAIMER::~RECLAIMER()
+{
+	{
+		lock_guard<mutex> lock(Mutex);
+		Stop = true;
+	}
+	Wake.notify_all();
+	Thread.join();
+}
+
+void RECLAIMER::Free(VNODE* subtree)
+{
+	assert(subtree);
+	{
+		lock_guard<mutex> lock(Mutex);
+		Jobs.push_back(JOB());
+		Jobs.back().Subtree = subtree;
+		Pending++;
+	}
+	Wake.notify_one();
+}
+
+void RECLAIMER::Free(BELIEF_STATE& beliefs)
+{
+	if (beliefs.Empty())
+		return;
+	{
+		lock_guard<mutex> lock(Mutex);
+		Jobs.push_back(JOB());
+		Jobs.back().Subtree = 0;
+		Jobs.back().Beliefs.Move(beliefs);
+		Pending++;
+	}
+	Wake.notify_one();
+}
+
+void RECLAIMER::Wait()
+{
+	unique_lock<mutex> lock(Mutex);
+	while (Pending > 0)
+		Done.wait(lock);
+}
+
+int RECLAIMER::GetNumPending() const
+{
+	lock_guard<mutex> lock(Mutex);
+	return Pending;
+}
+
+void RECLAIMER::WorkerLoop()
+{
+	unique_lock<mutex> lock(Mutex);
+	while (true)
+	{
+		// Pending work is always finished before stopping
+		while (Jobs.empty() && !Stop)
+			Wake.wait(lock);
+		if (Jobs.empty())
+			return;
+
+		JOB job;
+		job.Subtree = Jobs.front().Subtree;
+		job.Beliefs.Move(Jobs.front().Beliefs);
+		Jobs.pop_front();
+		lock.unlock();
+
+		if (job.Subtree)
+			Arena.Free(job.Subtree, Simulator);
+		job.Beliefs.Free(Simulator);
+
+		lock.lock();
+		if (--Pending == 0)
+			Done.notify_all();
+	}
+}
+
+void RECLAIMER::UnitTest()
+{
+	TEST_SIMULATOR testSimulator(2, 4, 1);
+	NODE_ARENA arena;
+	vector<VNODE*> nodes;
+	for (int i = 0; i < 3; i++)
+		nodes.push_back(arena.Create(2));
+	nodes[0]->Child(1, arena).SetChild(2, nodes[1]->GetHandle());
+	nodes[0]->Beliefs().AddSample(testSimulator.CreateStartState());
+	nodes[1]->Beliefs().AddSample(testSimulator.CreateStartState());
+
+	// Subtrees and particles are freed in the background while the arena
+	// is still in use
+	{
+		RECLAIMER reclaimer(testSimulator, arena);
+		BELIEF_STATE beliefs;
+		beliefs.AddSample(testSimulator.CreateStartState());
+		reclaimer.Free(nodes[0]);
+		reclaimer.Free(beliefs);
+		assert(beliefs.Empty());
+		VNODE* vnode = arena.Create(2);
+		reclaimer.Wait();
+		assert(reclaimer.GetNumPending() == 0);
+		assert(arena.GetNumAllocated() == 2);
+
+		// Anything still pending is freed on destruction
+		reclaimer.Free(vnode);
+	}
+	assert(arena.GetNumAllocated() == 1);
+}
+
+//-----------------------------------------------------------------------------
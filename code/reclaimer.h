@@ -0,0 +1,58 @@
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include "node.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+//-----------------------------------------------------------------------------
+// Frees detached subtrees and particles on a background thread, so that
+// a step can carry on as soon as its new root is installed. Subtrees must
+// already be unlinked from the tree, and their nodes are returned to the
+// arena once the walk is done. Wait blocks until everything handed over
+// has been freed, which must happen before the arena is reset.
+
+class RECLAIMER
+{
+public:
+
+	RECLAIMER(const SIMULATOR& simulator, NODE_ARENA& arena);
+	~RECLAIMER(); // frees everything still pending
+
+	// Subtree and all its particles, now owned by the reclaimer
+	void Free(VNODE* subtree);
+
+	// Particles are taken from beliefs, which are left empty
+	void Free(BELIEF_STATE& beliefs);
+
+	void Wait();
+
+	int GetNumPending() const;
+
+	static void UnitTest();
+
+private:
+
+	struct JOB
+	{
+		VNODE* Subtree;
+		BELIEF_STATE Beliefs;
+	};
+
+	void WorkerLoop();
+
+	const SIMULATOR& Simulator;
+	NODE_ARENA& Arena;
+	std::deque<JOB> Jobs;
+	int Pending; // jobs queued or being freed
+	bool Stop;
+	mutable std::mutex Mutex;
+	std::condition_variable Wake, Done;
+	std::thread Thread;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif // RECLAIMER_H
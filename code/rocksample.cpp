@@ -108,6 +108,11 @@ STATE* ROCKSAMPLE::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* ROCKSAMPLE::Clone() const
+{
+	return new ROCKSAMPLE(*this);
+}
+
 void ROCKSAMPLE::Validate(const STATE& state) const
 {
 	const ROCKSAMPLE_STATE& rockstate = safe_cast<const ROCKSAMPLE_STATE&>(state);
@@ -141,6 +146,11 @@ void ROCKSAMPLE::FreeState(STATE* state) const
 	MemoryPool.Free(rockstate);
 }
 
+void ROCKSAMPLE::TrimMemory() const
+{
+	MemoryPool.Trim();
+}
+
 bool ROCKSAMPLE::Step(STATE& state, int action,
 	int& observation, double& reward) const
 {
@@ -438,6 +448,26 @@ int ROCKSAMPLE::SelectTarget(const ROCKSAMPLE_STATE& rockstate) const
 	return bestRock;
 }
 
+double ROCKSAMPLE::BeliefEntropy(const BELIEF_STATE& beliefs) const
+{
+	// Sum of the entropies of whether each rock is valuable
+	if (beliefs.Empty())
+		return 0;
+	vector<int> numValuable(NumRocks, 0);
+	for (int i = 0; i < beliefs.GetNumSamples(); i++)
+	{
+		const ROCKSAMPLE_STATE& rockstate =
+			safe_cast<const ROCKSAMPLE_STATE&>(*beliefs.GetSample(i));
+		for (int rock = 0; rock < NumRocks; rock++)
+			numValuable[rock] += rockstate.Rocks[rock].Valuable;
+	}
+
+	double entropy = 0;
+	for (int rock = 0; rock < NumRocks; rock++)
+		entropy += BinaryEntropy((double)numValuable[rock] / beliefs.GetNumSamples());
+	return entropy;
+}
+
 void ROCKSAMPLE::DisplayBeliefs(const BELIEF_STATE& beliefState,
 	std::ostream& ostr) const
 {
@@ -31,9 +31,11 @@ public:
 	ROCKSAMPLE(int size, int rocks);
 
 	virtual STATE* Copy(const STATE& state) const;
+	virtual SIMULATOR* Clone() const;
 	virtual void Validate(const STATE& state) const;
 	virtual STATE* CreateStartState() const;
 	virtual void FreeState(STATE* state) const;
+	virtual void TrimMemory() const;
 	virtual bool Step(STATE& state, int action,
 		int& observation, double& reward) const;
 
@@ -44,6 +46,7 @@ public:
 	virtual bool LocalMove(STATE& state, const HISTORY& history,
 		int stepObservation, const STATUS& status) const;
 
+	virtual double BeliefEntropy(const BELIEF_STATE& beliefs) const;
 	virtual void DisplayBeliefs(const BELIEF_STATE& beliefState,
 		std::ostream& ostr) const;
 	virtual void DisplayState(const STATE& state, std::ostream& ostr) const;
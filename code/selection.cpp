@@ -0,0 +1,400 @@
+#include "selection.h"
+#include "utils.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SELECTION_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace UTILS;
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	int DetectLevel()
+	{
+#ifdef SELECTION_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return SELECTION::AVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return SELECTION::SSE2;
+#endif
+		return SELECTION::SCALAR;
+	}
+
+	const int MaxLevel = DetectLevel();
+	int Level = MaxLevel;
+
+	double ScoreScalar(const SELECTION::INPUT& input, int action)
+	{
+		int n = input.Shared ? AtomicLoad(input.Counts[action]) : input.Counts[action];
+		double total = input.Shared ? AtomicLoad(input.Totals[action]) : input.Totals[action];
+		double q = n == 0 ? total : total / n;
+
+		if (input.AMAFCounts)
+		{
+			double n2 = input.Shared ? AtomicLoad(input.AMAFCounts[action]) : input.AMAFCounts[action];
+			if (n2 > 0)
+			{
+				double amafTotal = input.Shared ? AtomicLoad(input.AMAFTotals[action]) : input.AMAFTotals[action];
+				double beta = n2 / (n + n2 + input.RaveConstant * n * n2);
+				q = (1.0 - beta) * q + beta * (amafTotal / n2);
+			}
+		}
+
+		if (input.AlphaValues && n > 0)
+		{
+			int alphan = input.AlphaCounts[action];
+			q = (n * q + alphan * input.AlphaValues[action]) / (n + alphan);
+		}
+
+		if (input.Exploration)
+		{
+			if (input.Table && n < input.TableSize)
+				q += input.Table[n];
+			else if (n == 0)
+				q += Infinity;
+			else
+				q += input.ExplorationConstant * sqrt(input.LogN / n);
+		}
+		return q;
+	}
+
+	void BestScalar(const double* scores, int numActions, vector<int>& best)
+	{
+		double bestq = -Infinity;
+		for (int action = 0; action < numActions; action++)
+		{
+			double q = scores[action];
+			if (q >= bestq)
+			{
+				if (q > bestq)
+					best.clear();
+				bestq = q;
+				best.push_back(action);
+			}
+		}
+	}
+
+#ifdef SELECTION_X86
+
+	// Two actions at a time, blending with masks as SSE2 has no blendv
+	__attribute__((target("sse2")))
+	__m128d Blend(__m128d a, __m128d b, __m128d mask)
+	{
+		return _mm_or_pd(_mm_and_pd(mask, b), _mm_andnot_pd(mask, a));
+	}
+
+	__attribute__((target("sse2")))
+	int ScoreSSE2(const SELECTION::INPUT& input, double* scores)
+	{
+		const __m128d zero = _mm_setzero_pd();
+		const __m128d one = _mm_set1_pd(1.0);
+		const __m128d raveConstant = _mm_set1_pd(input.RaveConstant);
+		const __m128d exploration = _mm_set1_pd(input.ExplorationConstant);
+		const __m128d logN = _mm_set1_pd(input.LogN);
+		const __m128d infinity = _mm_set1_pd(Infinity);
+
+		int action;
+		for (action = 0; action + 2 <= input.NumActions; action += 2)
+		{
+			__m128d n = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(input.Counts + action)));
+			__m128d total = _mm_loadu_pd(input.Totals + action);
+			__m128d unvisited = _mm_cmpeq_pd(n, zero);
+			__m128d q = Blend(_mm_div_pd(total, n), total, unvisited);
+
+			if (input.AMAFCounts)
+			{
+				__m128d n2 = _mm_loadu_pd(input.AMAFCounts + action);
+				__m128d amafTotal = _mm_loadu_pd(input.AMAFTotals + action);
+				__m128d beta = _mm_div_pd(n2, _mm_add_pd(_mm_add_pd(n, n2),
+					_mm_mul_pd(_mm_mul_pd(raveConstant, n), n2)));
+				__m128d rave = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(one, beta), q),
+					_mm_mul_pd(beta, _mm_div_pd(amafTotal, n2)));
+				q = Blend(q, rave, _mm_cmpgt_pd(n2, zero));
+			}
+
+			if (input.Exploration)
+			{
+				__m128d bonus = _mm_mul_pd(exploration, _mm_sqrt_pd(_mm_div_pd(logN, n)));
+				bonus = Blend(bonus, infinity, unvisited);
+				if (input.Table)
+				{
+					double bonuses[2];
+					_mm_storeu_pd(bonuses, bonus);
+					for (int i = 0; i < 2; i++)
+						if (input.Counts[action + i] < input.TableSize)
+							bonuses[i] = input.Table[input.Counts[action + i]];
+					bonus = _mm_loadu_pd(bonuses);
+				}
+				q = _mm_add_pd(q, bonus);
+			}
+			_mm_storeu_pd(scores + action, q);
+		}
+		return action;
+	}
+
+	__attribute__((target("sse2")))
+	void BestSSE2(const double* scores, int numActions, vector<int>& best)
+	{
+		// Highest score first, then every action reaching it in order
+		__m128d bestq = _mm_set1_pd(-Infinity);
+		int action;
+		for (action = 0; action + 2 <= numActions; action += 2)
+		{
+			__m128d q = _mm_loadu_pd(scores + action);
+			bestq = Blend(bestq, q, _mm_cmpgt_pd(q, bestq));
+		}
+		double lanes[2];
+		_mm_storeu_pd(lanes, bestq);
+		double maxq = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+		for (int a = action; a < numActions; a++)
+			if (scores[a] > maxq)
+				maxq = scores[a];
+
+		__m128d target = _mm_set1_pd(maxq);
+		for (action = 0; action + 2 <= numActions; action += 2)
+		{
+			int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(scores + action), target));
+			for (; mask; mask &= mask - 1)
+				best.push_back(action + __builtin_ctz(mask));
+		}
+		for (; action < numActions; action++)
+			if (scores[action] == maxq)
+				best.push_back(action);
+	}
+
+	__attribute__((target("avx2")))
+	int ScoreAVX2(const SELECTION::INPUT& input, double* scores)
+	{
+		const __m256d zero = _mm256_setzero_pd();
+		const __m256d one = _mm256_set1_pd(1.0);
+		const __m256d raveConstant = _mm256_set1_pd(input.RaveConstant);
+		const __m256d exploration = _mm256_set1_pd(input.ExplorationConstant);
+		const __m256d logN = _mm256_set1_pd(input.LogN);
+		const __m256d infinity = _mm256_set1_pd(Infinity);
+		const __m128i tableSize = _mm_set1_epi32(input.TableSize);
+
+		int action;
+		for (action = 0; action + 4 <= input.NumActions; action += 4)
+		{
+			__m128i count = _mm_loadu_si128((const __m128i*)(input.Counts + action));
+			__m256d n = _mm256_cvtepi32_pd(count);
+			__m256d total = _mm256_loadu_pd(input.Totals + action);
+			__m256d unvisited = _mm256_cmp_pd(n, zero, _CMP_EQ_OQ);
+			__m256d q = _mm256_blendv_pd(_mm256_div_pd(total, n), total, unvisited);
+
+			if (input.AMAFCounts)
+			{
+				__m256d n2 = _mm256_loadu_pd(input.AMAFCounts + action);
+				__m256d amafTotal = _mm256_loadu_pd(input.AMAFTotals + action);
+				__m256d beta = _mm256_div_pd(n2, _mm256_add_pd(_mm256_add_pd(n, n2),
+					_mm256_mul_pd(_mm256_mul_pd(raveConstant, n), n2)));
+				__m256d rave = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(one, beta), q),
+					_mm256_mul_pd(beta, _mm256_div_pd(amafTotal, n2)));
+				q = _mm256_blendv_pd(q, rave, _mm256_cmp_pd(n2, zero, _CMP_GT_OQ));
+			}
+
+			if (input.Exploration)
+			{
+				__m256d bonus = _mm256_mul_pd(exploration, _mm256_sqrt_pd(_mm256_div_pd(logN, n)));
+				bonus = _mm256_blendv_pd(bonus, infinity, unvisited);
+				if (input.Table)
+				{
+					// Counts are never negative, so only the upper bound is checked
+					__m128i inTable = _mm_cmpgt_epi32(tableSize, count);
+					__m256d mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(inTable));
+					bonus = _mm256_mask_i32gather_pd(bonus, input.Table, count, mask, 8);
+				}
+				q = _mm256_add_pd(q, bonus);
+			}
+			_mm256_storeu_pd(scores + action, q);
+		}
+		return action;
+	}
+
+	__attribute__((target("avx2")))
+	void BestAVX2(const double* scores, int numActions, vector<int>& best)
+	{
+		__m256d bestq = _mm256_set1_pd(-Infinity);
+		int action;
+		for (action = 0; action + 4 <= numActions; action += 4)
+		{
+			__m256d q = _mm256_loadu_pd(scores + action);
+			bestq = _mm256_blendv_pd(bestq, q, _mm256_cmp_pd(q, bestq, _CMP_GT_OQ));
+		}
+		double lanes[4];
+		_mm256_storeu_pd(lanes, bestq);
+		double maxq = lanes[0];
+		for (int i = 1; i < 4; i++)
+			if (lanes[i] > maxq)
+				maxq = lanes[i];
+		for (int a = action; a < numActions; a++)
+			if (scores[a] > maxq)
+				maxq = scores[a];
+
+		__m256d target = _mm256_set1_pd(maxq);
+		for (action = 0; action + 4 <= numActions; action += 4)
+		{
+			int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(scores + action), target, _CMP_EQ_OQ));
+			for (; mask; mask &= mask - 1)
+				best.push_back(action + __builtin_ctz(mask));
+		}
+		for (; action < numActions; action++)
+			if (scores[action] == maxq)
+				best.push_back(action);
+	}
+
+#endif // SELECTION_X86
+}
+
+//-----------------------------------------------------------------------------
+
+namespace SELECTION
+{
+
+INPUT::INPUT()
+	: NumActions(0),
+	Counts(0),
+	Totals(0),
+	AMAFCounts(0),
+	AMAFTotals(0),
+	RaveConstant(0),
+	AlphaValues(0),
+	AlphaCounts(0),
+	Exploration(false),
+	Table(0),
+	TableSize(0),
+	ExplorationConstant(0),
+	LogN(0),
+	Shared(false)
+{
+}
+
+void Select(const INPUT& input, vector<double>& scores, vector<int>& best)
+{
+	// Vector loads are not atomic, so shared statistics are read one by one
+	int level = input.Shared || input.AlphaValues ? SCALAR : Level;
+	scores.resize(input.NumActions);
+	best.clear();
+
+	int action = 0;
+#ifdef SELECTION_X86
+	if (level == AVX2)
+		action = ScoreAVX2(input, &scores[0]);
+	else if (level == SSE2)
+		action = ScoreSSE2(input, &scores[0]);
+#endif
+	for (; action < input.NumActions; action++)
+		scores[action] = ScoreScalar(input, action);
+
+#ifdef SELECTION_X86
+	if (level == AVX2)
+	{
+		BestAVX2(&scores[0], input.NumActions, best);
+		return;
+	}
+	if (level == SSE2)
+	{
+		BestSSE2(&scores[0], input.NumActions, best);
+		return;
+	}
+#endif
+	BestScalar(&scores[0], input.NumActions, best);
+}
+
+const double* Widen(const float* values, int n, double* scratch, bool shared)
+{
+	for (int i = 0; i < n; i++)
+		scratch[i] = shared ? AtomicLoad(values[i]) : values[i];
+	return scratch;
+}
+
+int GetLevel()
+{
+	return Level;
+}
+
+void SetLevel(int level)
+{
+	Level = min(level, MaxLevel);
+}
+
+void UnitTest()
+{
+	// Random statistics with many ties, unvisited actions, prior counts
+	// beyond the table and actions ruled out by prior knowledge
+	const int tableSize = 100;
+	const double exploration = 1.5;
+	int savedLevel = GetLevel();
+	for (int test = 0; test < 1000; test++)
+	{
+		int numActions = 1 + Random(13);
+		int parentCount = Random(200);
+		vector<int> counts(numActions), alphaCounts(numActions);
+		vector<double> totals(numActions), amafCounts(numActions), amafTotals(numActions);
+		vector<double> alphaValues(numActions), table(tableSize);
+		for (int action = 0; action < numActions; action++)
+		{
+			int kind = Random(4);
+			counts[action] = kind == 0 ? 0 : kind == 1 ? LargeInteger : Random(150);
+			totals[action] = kind == 1 ? -Infinity * LargeInteger : Random(3) * counts[action];
+			amafCounts[action] = Random(3) == 0 ? 0 : Random(50) * 0.5;
+			amafTotals[action] = Random(3) * amafCounts[action];
+			alphaCounts[action] = Random(5);
+			alphaValues[action] = Random(3);
+		}
+		for (int n = 0; n < tableSize; n++)
+			table[n] = n == 0 ? Infinity : exploration * sqrt(log(parentCount + 1.0) / n);
+
+		INPUT input;
+		input.NumActions = numActions;
+		input.Counts = &counts[0];
+		input.Totals = &totals[0];
+		if (Bernoulli(0.5))
+		{
+			input.AMAFCounts = &amafCounts[0];
+			input.AMAFTotals = &amafTotals[0];
+			input.RaveConstant = 0.01;
+		}
+		if (Bernoulli(0.1))
+		{
+			input.AlphaValues = &alphaValues[0];
+			input.AlphaCounts = &alphaCounts[0];
+		}
+		input.Exploration = Bernoulli(0.8);
+		if (Bernoulli(0.5))
+		{
+			input.Table = &table[0];
+			input.TableSize = tableSize;
+		}
+		input.ExplorationConstant = exploration;
+		input.LogN = log(parentCount + 1.0);
+
+		SetLevel(SCALAR);
+		vector<double> expectedScores;
+		vector<int> expectedBest;
+		Select(input, expectedScores, expectedBest);
+		assert(!expectedBest.empty());
+
+		// Identical to the last bit at every level the processor supports
+		for (int level = SSE2; level <= MaxLevel; level++)
+		{
+			SetLevel(level);
+			vector<double> scores;
+			vector<int> best;
+			Select(input, scores, best);
+			assert(memcmp(&scores[0], &expectedScores[0], numActions * sizeof(double)) == 0);
+			assert(best == expectedBest);
+		}
+	}
+	SetLevel(savedLevel);
+}
+
+}
+
+//-----------------------------------------------------------------------------
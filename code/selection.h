@@ -0,0 +1,62 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Scores and greedy choice of the actions of one node, computed over the
+// contiguous per-action statistics of a VNODE. Vector kernels for SSE2 and
+// AVX2 are chosen at run time and use the same operations in the same
+// order as the scalar code, so every level gives identical scores and
+// the same set of best actions.
+
+namespace SELECTION
+{
+	enum
+	{
+		SCALAR = 0,
+		SSE2 = 1,
+		AVX2 = 2
+	};
+
+	struct INPUT
+	{
+		INPUT();
+
+		int NumActions;
+		const int* Counts;
+		const double* Totals;
+		const double* AMAFCounts; // blended in when given
+		const double* AMAFTotals;
+		double RaveConstant;
+		const double* AlphaValues; // combined with the value when given
+		const int* AlphaCounts;
+		bool Exploration; // add the UCB exploration bonus
+		const double* Table; // fast UCB row for the parent count, if any
+		int TableSize;
+		double ExplorationConstant;
+		double LogN; // log of the parent count plus one
+		bool Shared; // statistics are being updated by other threads
+	};
+
+	// Fill scores with the score of every action and best with the
+	// actions of highest score, in increasing order
+	void Select(const INPUT& input, std::vector<double>& scores, std::vector<int>& best);
+
+	// Statistics as the doubles read by Select, widened into scratch
+	// when they are held in single precision
+	inline const double* Widen(const double* values, int n, double* scratch, bool shared) { return values; }
+	const double* Widen(const float* values, int n, double* scratch, bool shared);
+
+	// Most capable level the processor supports, or the level set
+	int GetLevel();
+
+	// Use at most level, for comparisons and testing
+	void SetLevel(int level);
+
+	void UnitTest();
+}
+
+//-----------------------------------------------------------------------------
+
+#endif // SELECTION_H
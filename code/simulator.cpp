@@ -6,8 +6,8 @@ using namespace std;
 using namespace UTILS;
 
 SIMULATOR::KNOWLEDGE::KNOWLEDGE()
-	: TreeLevel(LEGAL),
-	RolloutLevel(LEGAL),
+	: RolloutLevel(LEGAL),
+	TreeLevel(LEGAL),
 	SmartTreeCount(10),
 	SmartTreeValue(1.0)
 {
@@ -33,9 +33,9 @@ SIMULATOR::STATUS::STATUS()
 }
 
 SIMULATOR::SIMULATOR()
-	: Discount(1.0),
-	NumActions(0),
+	: NumActions(0),
 	NumObservations(0),
+	Discount(1.0),
 	RewardRange(1.0)
 {
 }
@@ -52,6 +52,10 @@ SIMULATOR::~SIMULATOR()
 {
 }
 
+void SIMULATOR::TrimMemory() const
+{
+}
+
 void SIMULATOR::Validate(const STATE& state) const
 {
 }
@@ -62,6 +66,11 @@ bool SIMULATOR::LocalMove(STATE& state, const HISTORY& history,
 	return true;
 }
 
+double SIMULATOR::BeliefEntropy(const BELIEF_STATE& beliefs) const
+{
+	return 0;
+}
+
 void SIMULATOR::GenerateLegal(const STATE& state, const HISTORY& history,
 	std::vector<int>& actions, const STATUS& status) const
 {
@@ -74,10 +83,11 @@ void SIMULATOR::GeneratePreferred(const STATE& state, const HISTORY& history,
 {
 }
 
-int SIMULATOR::SelectRandom(const STATE& state, const HISTORY& history,
-	const STATUS& status) const
+int SIMULATOR::SelectRandom(const STATE& state, CONTEXT& context) const
 {
-	static vector<int> actions;
+	vector<int>& actions = context.Actions;
+	const HISTORY& history = context.History;
+	const STATUS& status = context.Status;
 	if (Knowledge.RolloutLevel >= KNOWLEDGE::SMART)
 	{
 		actions.clear();
@@ -97,10 +107,11 @@ int SIMULATOR::SelectRandom(const STATE& state, const HISTORY& history,
 	return Random(NumActions);
 }
 
-void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
-	VNODE* vnode, const STATUS& status) const
+void SIMULATOR::Prior(const STATE* state, CONTEXT& context, VNODE* vnode) const
 {
-	static vector<int> actions;
+	vector<int>& actions = context.Actions;
+	const HISTORY& history = context.History;
+	const STATUS& status = context.Status;
 
 	if (Knowledge.TreeLevel == KNOWLEDGE::PURE || state == 0)
 	{
@@ -120,9 +131,9 @@ void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
 		for (vector<int>::const_iterator i_action = actions.begin(); i_action != actions.end(); ++i_action)
 		{
 			int a = *i_action;
-			QNODE& qnode = vnode->Child(a);
-			qnode.Value.Set(0, 0);
-			qnode.AMAF.Set(0, 0);
+			vnode->ActionValue(a).Set(0, 0);
+			if (VNODE::HasAMAF)
+				vnode->ActionAMAF(a).Set(0, 0);
 		}
 	}
 
@@ -134,9 +145,9 @@ void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
 		for (vector<int>::const_iterator i_action = actions.begin(); i_action != actions.end(); ++i_action)
 		{
 			int a = *i_action;
-			QNODE& qnode = vnode->Child(a);
-			qnode.Value.Set(Knowledge.SmartTreeCount, Knowledge.SmartTreeValue);
-			qnode.AMAF.Set(Knowledge.SmartTreeCount, Knowledge.SmartTreeValue);
+			vnode->ActionValue(a).Set(Knowledge.SmartTreeCount, Knowledge.SmartTreeValue);
+			if (VNODE::HasAMAF)
+				vnode->ActionAMAF(a).Set(Knowledge.SmartTreeCount, Knowledge.SmartTreeValue);
 		}
 	}
 }
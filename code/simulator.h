@@ -72,6 +72,21 @@ public:
 		int Particles;
 	};
 
+	// Everything a search thread modifies on the way down the tree.
+	// Each thread owns one, so simulators and searches keep no mutable
+	// state of their own and many planners can share a process.
+	struct CONTEXT
+	{
+		HISTORY History;
+		STATUS Status;
+		std::vector<int> Actions; // scratch for generated actions
+		std::vector<int> BestActions; // scratch for greedy action selection
+		std::vector<double> Scores; // scratch for the scores of each action
+		std::vector<double> Widened; // scratch for statistics held in single precision
+		std::vector<double> AlphaValues; // scratch for alpha vector values of each action
+		std::vector<int> AlphaCounts;
+	};
+
 	SIMULATOR();
 	SIMULATOR(int numActions, int numObservations, double discount = 1.0);
 	virtual ~SIMULATOR();
@@ -90,6 +105,12 @@ public:
 	// Create new state and copy argument (must be same type)
 	virtual STATE* Copy(const STATE& state) const = 0;
 
+	// Create independent copy of simulator, with its own memory pool
+	virtual SIMULATOR* Clone() const = 0;
+
+	// Return memory held for states that are no longer live, between episodes
+	virtual void TrimMemory() const;
+
 	// Sanity check
 	virtual void Validate(const STATE& state) const;
 
@@ -99,13 +120,15 @@ public:
 
 	// Use domain knowledge to assign prior value and confidence to actions
 	// Should only use fully observable state variables
-	void Prior(const STATE* state, const HISTORY& history, VNODE* vnode,
-		const STATUS& status) const;
+	void Prior(const STATE* state, CONTEXT& context, VNODE* vnode) const;
 
 	// Use domain knowledge to select actions stochastically during rollouts
 	// Should only use fully observable state variables
-	int SelectRandom(const STATE& state, const HISTORY& history,
-		const STATUS& status) const;
+	int SelectRandom(const STATE& state, CONTEXT& context) const;
+
+	// Uncertainty of the beliefs, summed over the state variables that the
+	// problem knows about. Zero if the problem does not measure it.
+	virtual double BeliefEntropy(const BELIEF_STATE& beliefs) const;
 
 	// Generate set of legal actions
 	virtual void GenerateLegal(const STATE& state, const HISTORY& history,
@@ -15,6 +15,7 @@ public:
 	STATISTIC(double val, int count);
 
 	void Add(double val);
+	void Merge(const STATISTIC& stat);
 	void Clear();
 	int GetCount() const;
 	void Initialise(double val, int count);
@@ -60,6 +61,23 @@ inline void STATISTIC::Add(double val)
 		Min = val;
 }
 
+inline void STATISTIC::Merge(const STATISTIC& stat)
+{
+	if (stat.Count == 0)
+		return;
+	int countOld = Count;
+	double delta = stat.Mean - Mean;
+	Count += stat.Count;
+	assert(Count > 0); // overflow
+	Mean += delta * stat.Count / Count;
+	Variance = (countOld * Variance + stat.Count * stat.Variance
+		+ delta * delta * countOld * stat.Count / Count) / Count;
+	if (stat.Max > Max)
+		Max = stat.Max;
+	if (stat.Min < Min)
+		Min = stat.Min;
+}
+
 inline void STATISTIC::Clear()
 {
 	Count = 0;
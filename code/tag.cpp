@@ -22,6 +22,11 @@ STATE* TAG::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* TAG::Clone() const
+{
+	return new TAG(*this);
+}
+
 void TAG::Validate(const STATE& state) const
 {
 	const TAG_STATE& tagstate = safe_cast<const TAG_STATE&>(state);
@@ -45,6 +50,11 @@ void TAG::FreeState(STATE* state) const
 	MemoryPool.Free(tagstate);
 }
 
+void TAG::TrimMemory() const
+{
+	MemoryPool.Trim();
+}
+
 bool TAG::Step(STATE& state, int action,
 	int& observation, double& reward) const
 {
@@ -166,30 +176,31 @@ void TAG::MoveOpponent(TAG_STATE& tagstate, int opp) const
 	const COORD& agent = tagstate.AgentPos;
 	COORD& opponent = tagstate.OpponentPos[opp];
 
-	static vector<int> actions;
-	actions.clear();
+	// At most eight candidate moves, kept on the stack
+	int actions[8];
+	int numActions = 0;
 
 	if (opponent.X >= agent.X)
-		actions.push_back(COORD::E_EAST);
+		actions[numActions++] = COORD::E_EAST;
 	if (opponent.Y >= agent.Y)
-		actions.push_back(COORD::E_NORTH);
+		actions[numActions++] = COORD::E_NORTH;
 	if (opponent.X <= agent.X)
-		actions.push_back(COORD::E_WEST);
+		actions[numActions++] = COORD::E_WEST;
 	if (opponent.Y <= agent.Y)
-		actions.push_back(COORD::E_SOUTH);
+		actions[numActions++] = COORD::E_SOUTH;
 	if (opponent.X == agent.X && opponent.Y > agent.Y)
-		actions.push_back(COORD::E_NORTH);
+		actions[numActions++] = COORD::E_NORTH;
 	if (opponent.Y == agent.Y && opponent.X > agent.X)
-		actions.push_back(COORD::E_EAST);
+		actions[numActions++] = COORD::E_EAST;
 	if (opponent.X == agent.X && opponent.Y < agent.Y)
-		actions.push_back(COORD::E_SOUTH);
+		actions[numActions++] = COORD::E_SOUTH;
 	if (opponent.Y == agent.Y && opponent.X < agent.X)
-		actions.push_back(COORD::E_WEST);
+		actions[numActions++] = COORD::E_WEST;
 
-	assert(!actions.empty());
+	assert(numActions > 0);
 	if (Bernoulli(0.8))
 	{
-		int d = actions[Random(actions.size())];
+		int d = actions[Random(numActions)];
 		if (Inside(opponent + COORD::Compass[d]))
 			opponent = opponent + COORD::Compass[d];
 	}
@@ -11,6 +11,11 @@ STATE* TEST_SIMULATOR::Copy(const STATE& state) const
 	return newstate;
 }
 
+SIMULATOR* TEST_SIMULATOR::Clone() const
+{
+	return new TEST_SIMULATOR(*this);
+}
+
 STATE* TEST_SIMULATOR::CreateStartState() const
 {
 	return new TEST_STATE;
@@ -26,6 +26,7 @@ public:
 	virtual bool Step(STATE& state, int action,
 		int& observation, double& reward) const;
 	virtual STATE* Copy(const STATE& state) const;
+	virtual SIMULATOR* Clone() const;
 	virtual void FreeState(STATE* state) const;
 
 	double OptimalValue() const;
@@ -0,0 +1,192 @@
+#include "threadpool.h"
+#include <assert.h>
+#include <chrono>
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	double Seconds(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+}
+
+THREAD_POOL::COUNTERS::COUNTERS()
+	: Tasks(0),
+	Steals(0),
+	BusyTime(0),
+	IdleTime(0)
+{
+}
+
+THREAD_POOL::THREAD_POOL(int numThreads)
+	: Task(0),
+	Busy(0),
+	Generation(0),
+	Stop(false)
+{
+	for (int i = 0; i < numThreads; i++)
+		Queues.push_back(new QUEUE);
+	for (int i = 1; i < numThreads; i++)
+		Threads.push_back(thread(&THREAD_POOL::WorkerLoop, this, i));
+}
+
+THREAD_POOL::~THREAD_POOL()
+{
+	{
+		lock_guard<mutex> lock(Mutex);
+		Stop = true;
+	}
+	Wake.notify_all();
+	for (int i = 0; i < Threads.size(); i++)
+		Threads[i].join();
+	for (int i = 0; i < Queues.size(); i++)
+		delete Queues[i];
+}
+
+void THREAD_POOL::Run(int numTasks, const TASK& task)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// Deal out contiguous blocks of tasks, stealing fixes any imbalance
+	int numThreads = Queues.size();
+	for (int i = 0; i < numThreads; i++)
+	{
+		lock_guard<mutex> lock(Queues[i]->Mutex);
+		for (int t = numTasks * i / numThreads; t < numTasks * (i + 1) / numThreads; t++)
+			Queues[i]->Tasks.push_back(t);
+	}
+
+	{
+		lock_guard<mutex> lock(Mutex);
+		Task = &task;
+		Busy = Threads.size();
+		Generation++;
+	}
+	Wake.notify_all();
+	Work(0);
+
+	// Every worker must be done with task before it goes out of scope
+	{
+		unique_lock<mutex> lock(Mutex);
+		while (Busy > 0)
+			Done.wait(lock);
+	}
+
+	double elapsed = Seconds(start);
+	for (int i = 0; i < numThreads; i++)
+		Queues[i]->Counters.IdleTime += elapsed;
+}
+
+void THREAD_POOL::WorkerLoop(int thread)
+{
+	int generation = 0;
+	unique_lock<mutex> lock(Mutex);
+	while (true)
+	{
+		while (!Stop && Generation == generation)
+			Wake.wait(lock);
+		if (Stop)
+			return;
+		generation = Generation;
+
+		lock.unlock();
+		Work(thread);
+		lock.lock();
+		if (--Busy == 0)
+			Done.notify_one();
+	}
+}
+
+void THREAD_POOL::Work(int thread)
+{
+	// No tasks are added during a run, so once every deque is empty we are done
+	COUNTERS& counters = Queues[thread]->Counters;
+	int task;
+	while (Pop(thread, task) || Steal(thread, task))
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		(*Task)(task, thread);
+		double busy = Seconds(start);
+		counters.Tasks++;
+		counters.BusyTime += busy;
+		counters.IdleTime -= busy;
+	}
+}
+
+bool THREAD_POOL::Pop(int thread, int& task)
+{
+	QUEUE& queue = *Queues[thread];
+	lock_guard<mutex> lock(queue.Mutex);
+	if (queue.Tasks.empty())
+		return false;
+	task = queue.Tasks.back();
+	queue.Tasks.pop_back();
+	return true;
+}
+
+bool THREAD_POOL::Steal(int thread, int& task)
+{
+	int numThreads = Queues.size();
+	for (int i = 1; i < numThreads; i++)
+	{
+		QUEUE& victim = *Queues[(thread + i) % numThreads];
+		lock_guard<mutex> lock(victim.Mutex);
+		if (!victim.Tasks.empty())
+		{
+			task = victim.Tasks.front();
+			victim.Tasks.pop_front();
+			Queues[thread]->Counters.Steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+THREAD_POOL::COUNTERS THREAD_POOL::GetTotalCounters() const
+{
+	COUNTERS total;
+	for (int i = 0; i < Queues.size(); i++)
+	{
+		const COUNTERS& counters = Queues[i]->Counters;
+		total.Tasks += counters.Tasks;
+		total.Steals += counters.Steals;
+		total.BusyTime += counters.BusyTime;
+		total.IdleTime += counters.IdleTime;
+	}
+	return total;
+}
+
+void THREAD_POOL::ClearCounters()
+{
+	for (int i = 0; i < Queues.size(); i++)
+		Queues[i]->Counters = COUNTERS();
+}
+
+void THREAD_POOL::UnitTest()
+{
+	// Uneven tasks are each run exactly once
+	THREAD_POOL pool(4);
+	vector<atomic<int> > runs(1000);
+	for (int i = 0; i < 1000; i++)
+		runs[i] = 0;
+	pool.Run(1000, [&](int task, int thread)
+	{
+		assert(thread >= 0 && thread < 4);
+		if (task < 10)
+			this_thread::sleep_for(chrono::milliseconds(1));
+		runs[task]++;
+	});
+	for (int i = 0; i < 1000; i++)
+		assert(runs[i] == 1);
+	assert(pool.GetTotalCounters().Tasks == 1000);
+
+	pool.ClearCounters();
+	pool.Run(0, [&](int task, int thread) { assert(false); });
+	assert(pool.GetTotalCounters().Tasks == 0);
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,75 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Work-stealing pool of persistent worker threads.
+// Run deals tasks 0..numTasks-1 out to per-thread deques. Each thread works
+// through its own deque and then steals from the others, and Run returns
+// once every task has completed. Tasks should be coarse batches of work.
+
+class THREAD_POOL
+{
+public:
+
+	// task(index, thread), the calling thread is thread 0
+	typedef std::function<void(int, int)> TASK;
+
+	// Load balancing counters per thread, accumulated until cleared
+	struct COUNTERS
+	{
+		COUNTERS();
+
+		int Tasks; // tasks executed
+		int Steals; // tasks taken from other threads
+		double BusyTime; // seconds spent executing tasks
+		double IdleTime; // seconds spent inside Run without a task
+	};
+
+	THREAD_POOL(int numThreads);
+	~THREAD_POOL();
+
+	void Run(int numTasks, const TASK& task);
+
+	// Number of threads running tasks, including the calling thread
+	int GetNumThreads() const { return Queues.size(); }
+	const COUNTERS& GetCounters(int thread) const { return Queues[thread]->Counters; }
+	COUNTERS GetTotalCounters() const;
+	void ClearCounters();
+
+	static void UnitTest();
+
+private:
+
+	struct QUEUE
+	{
+		std::mutex Mutex;
+		std::deque<int> Tasks;
+		COUNTERS Counters;
+	};
+
+	void WorkerLoop(int thread);
+	void Work(int thread);
+	bool Pop(int thread, int& task);
+	bool Steal(int thread, int& task);
+
+	std::vector<QUEUE*> Queues;
+	std::vector<std::thread> Threads;
+	std::mutex Mutex;
+	std::condition_variable Wake, Done;
+	const TASK* Task;
+	int Busy;
+	int Generation;
+	bool Stop;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif // THREAD_POOL_H
@@ -7,7 +7,9 @@
 #include <assert.h>
 #include "coord.h"
 #include "memorypool.h"
+#include "random.h"
 #include <algorithm>
+#include <thread>
 
 #define LargeInteger 1000000
 #define Infinity 1e+10
@@ -27,29 +29,45 @@ namespace UTILS
 		return (x > 0) - (x < 0);
 	}
 
+	// Random numbers come from the generator of the calling thread
 	inline int Random(int max)
 	{
-		return rand() % max;
+		return RANDOM::Thread().Random(max);
 	}
 
 	inline int Random(int min, int max)
 	{
-		return rand() % (max - min) + min;
+		return RANDOM::Thread().Random(max - min) + min;
 	}
 
 	inline double RandomDouble(double min, double max)
 	{
-		return (double)rand() / RAND_MAX * (max - min) + min;
+		return RANDOM::Thread().RandomDouble() * (max - min) + min;
 	}
 
 	inline void RandomSeed(int seed)
 	{
-		srand(seed);
+		RANDOM::Thread().Seed(seed);
 	}
 
 	inline bool Bernoulli(double p)
 	{
-		return rand() < p * RAND_MAX;
+		return RANDOM::Thread().RandomDouble() < p;
+	}
+
+	// Entropy in nats of a coin with probability p of heads
+	inline double BinaryEntropy(double p)
+	{
+		if (p <= 0 || p >= 1)
+			return 0;
+		return -p * log(p) - (1 - p) * log(1 - p);
+	}
+
+	template<class T>
+	inline void Shuffle(std::vector<T>& vec)
+	{
+		for (int i = (int)vec.size() - 1; i > 0; --i)
+			std::swap(vec[i], vec[Random(i + 1)]);
 	}
 
 	inline bool Near(double x, double y, double tol)
@@ -57,6 +75,82 @@ namespace UTILS
 		return fabs(x - y) <= tol;
 	}
 
+	// Lock-free access to plain variables shared between search threads
+	template<class T>
+	inline T AtomicLoad(const T& x)
+	{
+		T value;
+		__atomic_load(&x, &value, __ATOMIC_ACQUIRE);
+		return value;
+	}
+
+	template<class T>
+	inline void AtomicStore(T& x, T value)
+	{
+		__atomic_store(&x, &value, __ATOMIC_RELEASE);
+	}
+
+	// Publishes desired if x still holds expected, otherwise loads x into expected
+	template<class T>
+	inline bool AtomicCompareExchange(T& x, T& expected, T desired)
+	{
+		return __atomic_compare_exchange(&x, &expected, &desired, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	inline void AtomicAdd(int& x, int delta)
+	{
+		__atomic_fetch_add(&x, delta, __ATOMIC_RELAXED);
+	}
+
+	inline void AtomicAdd(double& x, double delta)
+	{
+		double oldValue = AtomicLoad(x);
+		double newValue;
+		do
+			newValue = oldValue + delta;
+		while (!__atomic_compare_exchange(&x, &oldValue, &newValue, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	inline void AtomicAdd(float& x, double delta)
+	{
+		float oldValue = AtomicLoad(x);
+		float newValue;
+		do
+			newValue = oldValue + delta;
+		while (!__atomic_compare_exchange(&x, &oldValue, &newValue, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	// Lock held for a few instructions, small enough to keep in every
+	// node of a shared tree. Usable with std::lock_guard, copies start
+	// unlocked.
+	class SPIN_LOCK
+	{
+	public:
+
+		SPIN_LOCK() : Locked(0) { }
+		SPIN_LOCK(const SPIN_LOCK&) : Locked(0) { }
+		SPIN_LOCK& operator=(const SPIN_LOCK&) { return *this; }
+
+		void lock()
+		{
+			int unlocked = 0;
+			while (!AtomicCompareExchange(Locked, unlocked, 1))
+			{
+				std::this_thread::yield();
+				unlocked = 0;
+			}
+		}
+
+		void unlock() { AtomicStore(Locked, 0); }
+
+	private:
+
+		int Locked;
+	};
+
 	inline bool CheckFlag(int flags, int bit) { return (flags & (1 << bit)) != 0; }
 
 	inline void SetFlag(int& flags, int bit) { flags = (flags | (1 << bit)); }